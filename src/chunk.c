@@ -0,0 +1,84 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "chunk.h"
+
+/* top bits that must be zero, more of them before the average size */
+#define MASK_SMALL (~0ULL << (64 - 18))
+#define MASK_LARGE (~0ULL << (64 - 14))
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fill the gear table from a fixed seed, so boundaries are the same on
+ * every run.
+ */
+static void gear_init(void)
+{
+   uint64_t seed = 0x6973736e61707368ULL;
+   int x;
+
+   for (x = 0; x < 256; x++)
+   {
+      uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      gear[x] = z ^ (z >> 31);
+   }
+}
+
+size_t chunk_boundary(const unsigned char* data, size_t len, bool eof)
+{
+   uint64_t hash = 0;
+   size_t end = len < CHUNK_MAX ? len : CHUNK_MAX;
+   size_t normal = end < CHUNK_AVG ? end : CHUNK_AVG;
+   size_t x;
+
+   if (len <= CHUNK_MIN)
+      return eof ? len : 0;
+
+   pthread_once(&gear_once, gear_init);
+
+   /* the hash only covers the last 64 bytes, start it just before min */
+   for (x = CHUNK_MIN - 64; x < CHUNK_MIN; x++)
+      hash = (hash << 1) + gear[data[x]];
+
+   for (; x < normal; x++)
+   {
+      hash = (hash << 1) + gear[data[x]];
+      if (!(hash & MASK_SMALL))
+	 return x + 1;
+   }
+
+   for (; x < end; x++)
+   {
+      hash = (hash << 1) + gear[data[x]];
+      if (!(hash & MASK_LARGE))
+	 return x + 1;
+   }
+
+   return eof || end == CHUNK_MAX ? end : 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/**
+ * @file
+ *
+ * Content-defined chunking, FastCDC style. A gear hash rolls over the
+ * data and a chunk ends where its top bits are all zero, so an edit only
+ * moves the boundaries next to it. A stricter mask before the average
+ * size and a looser one after it keep chunk sizes close to the average.
+ */
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+
+/**
+ * Find where the chunk starting at data ends.
+ *
+ * @param eof Whether data runs to the end of the file.
+ * @return the chunk length, or 0 if more data is needed to tell.
+ */
+size_t chunk_boundary(const unsigned char* data, size_t len, bool eof);
+
+#endif
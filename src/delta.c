@@ -0,0 +1,366 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "delta.h"
+#include "sha256.h"
+
+#define DELTA_MIN_BLOCK 4096
+#define DELTA_MAX_BLOCK (128 * 1024)
+
+/* only this much of the strong hash is kept */
+#define STRONG_SIZE 16
+
+struct delta_block
+{
+   uint32_t weak;
+   uint32_t index;
+   unsigned char strong[STRONG_SIZE];
+};
+
+struct delta_index
+{
+   size_t block;
+   size_t count;
+   /* open addressed on the weak checksum, index + 1 of a block or 0 */
+   uint32_t* table;
+   size_t mask;
+   struct delta_block* blocks;
+};
+
+/**
+ * The rsync rolling checksum, two 16 bit sums.
+ */
+struct rolling
+{
+   uint32_t a;
+   uint32_t b;
+};
+
+static inline void rolling_init(struct rolling* r, const unsigned char* data,
+				size_t len)
+{
+   size_t x;
+
+   r->a = r->b = 0;
+   for (x = 0; x < len; x++)
+   {
+      r->a += data[x];
+      r->b += r->a;
+   }
+}
+
+static inline void rolling_roll(struct rolling* r, unsigned char out,
+				unsigned char in, size_t len)
+{
+   r->a += in - out;
+   r->b += r->a - len * out;
+}
+
+static inline uint32_t rolling_digest(const struct rolling* r)
+{
+   return (r->a & 0xffff) | (r->b << 16);
+}
+
+static void strong_hash(const unsigned char* data, size_t len,
+			unsigned char strong[STRONG_SIZE])
+{
+   unsigned char digest[SHA256_SIZE];
+   struct sha256 ctx;
+
+   sha256_init(&ctx);
+   sha256_update(&ctx, data, len);
+   sha256_final(&ctx, digest);
+   memcpy(strong, digest, STRONG_SIZE);
+}
+
+static inline size_t weak_slot(uint32_t weak, size_t mask)
+{
+   return (weak * 0x9e3779b1U) & mask;
+}
+
+size_t delta_block_size(off_t size)
+{
+   size_t block = DELTA_MIN_BLOCK;
+
+   while (block < DELTA_MAX_BLOCK && (off_t)(block * block) < size)
+      block *= 2;
+
+   return block;
+}
+
+/**
+ * Read up to len bytes at offset, short only at the end of the file.
+ */
+static ssize_t read_full(int fd, unsigned char* buffer, size_t len, off_t offset)
+{
+   size_t done = 0;
+
+   while (done < len)
+   {
+      ssize_t bytes = offset < 0 ? read(fd, buffer + done, len - done) :
+	 pread(fd, buffer + done, len - done, offset + done);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+      if (bytes < 0)
+	 return -1;
+      if (bytes == 0)
+	 break;
+
+      done += bytes;
+   }
+
+   return done;
+}
+
+struct delta_index* delta_index_new(int fd, size_t block)
+{
+   struct delta_index* index =
+      (struct delta_index*)calloc(1, sizeof(*index));
+   unsigned char* buffer = (unsigned char*)malloc(block);
+   size_t size = 0;
+   off_t offset = 0;
+   ssize_t bytes;
+
+   if (!index || !buffer)
+      goto error;
+
+   index->block = block;
+
+   /* a short last block can only be sent as literal data */
+   while ((bytes = read_full(fd, buffer, block, offset)) == (ssize_t)block)
+   {
+      if (index->count == size)
+      {
+	 size_t n = size ? size * 2 : 256;
+	 struct delta_block* blocks = (struct delta_block*)
+	    realloc(index->blocks, n * sizeof(*blocks));
+
+	 if (!blocks)
+	    goto error;
+
+	 index->blocks = blocks;
+	 size = n;
+      }
+
+      struct delta_block* b = &index->blocks[index->count];
+      struct rolling r;
+
+      rolling_init(&r, buffer, block);
+      b->weak = rolling_digest(&r);
+      b->index = index->count++;
+      strong_hash(buffer, block, b->strong);
+
+      offset += block;
+   }
+
+   if (bytes < 0)
+      goto error;
+
+   for (index->mask = 15; index->mask < index->count * 2; index->mask = index->mask * 2 + 1)
+      ;
+
+   index->table = (uint32_t*)calloc(index->mask + 1, sizeof(uint32_t));
+   if (!index->table)
+      goto error;
+
+   size_t x;
+   for (x = 0; x < index->count; x++)
+   {
+      size_t slot = weak_slot(index->blocks[x].weak, index->mask);
+
+      while (index->table[slot])
+	 slot = (slot + 1) & index->mask;
+      index->table[slot] = x + 1;
+   }
+
+   free(buffer);
+   return index;
+
+ error:
+   free(buffer);
+   delta_index_free(index);
+   return NULL;
+}
+
+void delta_index_free(struct delta_index* index)
+{
+   if (index)
+   {
+      free(index->table);
+      free(index->blocks);
+      free(index);
+   }
+}
+
+/**
+ * Find an old block holding the window, preferring the one right after
+ * the last match so runs stay contiguous.
+ *
+ * @return the block number, or -1.
+ */
+static long find_block(struct delta_index* index, uint32_t weak,
+		       const unsigned char* window, long expected)
+{
+   unsigned char strong[STRONG_SIZE];
+   bool hashed = false;
+   long result = -1;
+   size_t slot;
+
+   for (slot = weak_slot(weak, index->mask); index->table[slot];
+	slot = (slot + 1) & index->mask)
+   {
+      struct delta_block* b = &index->blocks[index->table[slot] - 1];
+
+      if (b->weak != weak)
+	 continue;
+
+      if (!hashed)
+      {
+	 strong_hash(window, index->block, strong);
+	 hashed = true;
+      }
+
+      if (!memcmp(b->strong, strong, STRONG_SIZE))
+      {
+	 result = b->index;
+	 if (result == expected)
+	    break;
+      }
+   }
+
+   return result;
+}
+
+bool delta_scan(struct delta_index* index, int fd, delta_emit emit, void* arg,
+		struct sha256* hash)
+{
+   size_t block = index->block;
+   size_t size = block * 8;
+   unsigned char* buffer = (unsigned char*)malloc(size);
+   size_t pos = 0;
+   size_t end = 0;
+   /* start of the literal data not emitted yet */
+   size_t literal = 0;
+   bool eof = false;
+   bool rolled = false;
+   struct rolling r;
+   /* pending run of old blocks */
+   off_t run_offset = 0;
+   size_t run_len = 0;
+   bool result = false;
+
+   if (!buffer)
+      return false;
+
+#define FLUSH_RUN()							\
+   do {									\
+      if (run_len && !emit(arg, NULL, run_offset, run_len))		\
+	 goto done;							\
+      run_len = 0;							\
+   } while (0)
+
+   for (;;)
+   {
+      if (pos + block > end && !eof)
+      {
+	 /* keep the window, emit the literal data before it */
+	 if (pos > literal)
+	 {
+	    FLUSH_RUN();
+	    if (!emit(arg, buffer + literal, 0, pos - literal))
+	       goto done;
+	 }
+
+	 memmove(buffer, buffer + pos, end - pos);
+	 end -= pos;
+	 literal = pos = 0;
+
+	 ssize_t bytes = read_full(fd, buffer + end, size - end, -1);
+
+	 if (bytes < 0)
+	    goto done;
+	 if (hash)
+	    sha256_update(hash, buffer + end, bytes);
+	 eof = end + bytes < size;
+	 end += bytes;
+	 continue;
+      }
+
+      if (pos + block > end)
+	 break;
+
+      if (!rolled)
+      {
+	 rolling_init(&r, buffer + pos, block);
+	 rolled = true;
+      }
+
+      long expected = run_len ? (long)((run_offset + run_len) / block) : -1;
+      long match = index->count ?
+	 find_block(index, rolling_digest(&r), buffer + pos, expected) : -1;
+
+      if (match >= 0)
+      {
+	 if (pos > literal)
+	 {
+	    FLUSH_RUN();
+	    if (!emit(arg, buffer + literal, 0, pos - literal))
+	       goto done;
+	 }
+
+	 if (run_len && match != expected)
+	    FLUSH_RUN();
+	 if (!run_len)
+	    run_offset = (off_t)match * block;
+	 run_len += block;
+
+	 pos += block;
+	 literal = pos;
+	 rolled = false;
+	 continue;
+      }
+
+      if (pos + block < end)
+	 rolling_roll(&r, buffer[pos], buffer[pos + block], block);
+      else
+	 rolled = false;
+      pos++;
+   }
+
+   FLUSH_RUN();
+   if (end > literal && !emit(arg, buffer + literal, 0, end - literal))
+      goto done;
+
+   result = true;
+
+#undef FLUSH_RUN
+
+ done:
+   free(buffer);
+   return result;
+}
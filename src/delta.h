@@ -0,0 +1,71 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/**
+ * @file
+ *
+ * rsync-style delta between an old and a new version of a file. The old
+ * version is indexed by a weak rolling checksum and a strong hash per
+ * block, then a window rolls over the new version one byte at a time
+ * looking for blocks that are already there.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct delta_index;
+struct sha256;
+
+/**
+ * Called for each run of the new file in order: literal data, or len
+ * bytes to take from the old file at old_offset when data is NULL.
+ */
+typedef bool (*delta_emit)(void* arg, const unsigned char* data,
+			   off_t old_offset, size_t len);
+
+/**
+ * Block size for a file of size bytes, about its square root.
+ */
+size_t delta_block_size(off_t size);
+
+/**
+ * Index the blocks of an open old file.
+ *
+ * @return NULL on a read error or out of memory.
+ */
+struct delta_index* delta_index_new(int fd, size_t block);
+
+void delta_index_free(struct delta_index* index);
+
+/**
+ * Scan an open new file against the index, reading it from its current
+ * offset on.
+ *
+ * @param hash If not NULL, everything read is added to it.
+ */
+bool delta_scan(struct delta_index* index, int fd, delta_emit emit, void* arg,
+		struct sha256* hash);
+
+#endif
@@ -31,6 +31,8 @@
  * snapshots of working directories or to do full system backups.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +40,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -46,6 +49,21 @@
 #include <getopt.h>
 #include <fnmatch.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <linux/fs.h>
+
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#include "manifest.h"
+#include "sha256.h"
+#include "chunk.h"
+#include "delta.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX 2048
@@ -56,9 +74,132 @@ static bool force_copy = false;
 static bool count_bytes = false;
 static off_t total_bytes = 0;
 static off_t bytes_copied = 0;
+static bool failed = false;
+static int jobs = 1;
+static int scan_jobs = 1;
+#ifdef HAVE_IO_URING
+/* batch the stat of directory entries, and copy with queued reads and writes */
+static bool use_uring = false;
+#endif
 static const char* date_format = "%m-%d-%y-%H-%M-%S";
 static const char* exclude_pattern = NULL;
 
+/* manifest of the previous backup, and the one being written */
+static bool use_manifest = true;
+static bool sorted_scan = false;
+static struct manifest* prev_manifest = NULL;
+static struct manifest_writer* new_manifest = NULL;
+static uint32_t dest_root = MANIFEST_NO_ROOT;
+
+/* content store under DESTINATION, with --store */
+#define STORE_DIR ".objects"
+static bool use_store = false;
+static char* store_path = NULL;
+static int store_fd = -1;
+static unsigned long store_serial = 0;
+
+/* chunk store under DESTINATION, with --chunks */
+#define CHUNK_DIR ".chunks"
+static bool use_chunks = false;
+static char* chunk_path = NULL;
+static int chunk_fd = -1;
+/* DESTINATION has a chunk store, so earlier backups may hold recipes */
+static bool old_recipes = false;
+
+/* files smaller than this are not worth chunking */
+#define CHUNK_MIN_FILE (1024 * 1024)
+#define CHUNK_BUFFER (4 * CHUNK_MAX)
+
+#define RECIPE_MAGIC "ISNAPCR1"
+
+/* build changed files from their previous version, with --delta */
+static bool use_delta = false;
+
+/* smaller files are just copied */
+#define DELTA_MIN_FILE (1024 * 1024)
+
+/* --blocks, to rewrite only the changed blocks of a clone */
+static bool use_blocks = false;
+
+/* size of the blocks compared, and the smallest file worth it */
+#define BLOCKS_SIZE (64 * 1024)
+#define BLOCKS_MIN_FILE (1024 * 1024)
+
+/* --append, to copy only what was appended to a file */
+static bool use_append = false;
+
+/* smaller files are simply copied again */
+#define APPEND_MIN_FILE (64 * 1024)
+
+/**
+ * When to clone file data instead of copying it.
+ */
+enum reflink_mode
+{
+   REFLINK_NEVER,
+   REFLINK_AUTO,
+   REFLINK_ALWAYS
+};
+
+static enum reflink_mode reflink = REFLINK_AUTO;
+
+/**
+ * How unchanged files point at their stored copy.
+ */
+enum link_mode
+{
+   LINK_SYMLINK,
+   LINK_HARD
+};
+
+static enum link_mode link_mode = LINK_SYMLINK;
+
+/* make unchanged directories a single symlink, with --link-dirs */
+static bool link_dirs = false;
+
+/**
+ * When to leave holes in copies: where the source has them, also for
+ * zeroed blocks, or never.
+ */
+enum sparse_mode
+{
+   SPARSE_NEVER,
+   SPARSE_AUTO,
+   SPARSE_ALWAYS
+};
+
+static enum sparse_mode sparse = SPARSE_AUTO;
+
+/* granularity at which zeros become holes with --sparse=always */
+#define ZERO_BLOCK 4096
+
+/* --nocache, to leave the page cache and access times alone */
+static bool nocache = false;
+
+/* --writeback window, 0 leaves flushing copies to the kernel */
+static off_t writeback_window = 0;
+
+/* --split, files this big and up are copied by --jobs threads at once */
+static off_t split_size = 0;
+
+/* the part of a split copy a thread takes at a time */
+#define SPLIT_RANGE (64 * 1024 * 1024)
+
+/**
+ * Copy buffer size, 0 picks one per file.
+ */
+static size_t buffer_size = 0;
+
+#define MAX_BUFFER_SIZE (1024 * 1024)
+#define BUFFER_ALIGN 4096
+
+/* files up to this size are copied with one read() and one write() */
+#define SMALL_FILE (16 * 1024)
+
+/* io_uring submission queue size and reads in flight per copied file */
+#define URING_DEPTH 64
+#define URING_COPY_SLOTS 8
+
 #define err(format, arg...)						\
    do {									\
       if (verbose)							\
@@ -147,6 +288,133 @@ static char* join_path(const char *path, const char *filename)
    return result;
 }
 
+/**
+ * Path of name inside dir, for messages and --exclude. Uses buffer
+ * unless dir is empty.
+ */
+static const char* entry_path(char* buffer, size_t size, const char* dir,
+			      const char* name)
+{
+   size_t len = strlen(dir);
+
+   if (!len)
+      return name;
+
+   snprintf(buffer, size, "%s%s%s", dir, dir[len-1] == '/' ? "" : "/", name);
+   return buffer;
+}
+
+/*
+ * statx() masks for what each decision needs. Regular files only need
+ * enough to tell whether they changed; the rest of their metadata is
+ * taken from the open file when they are copied.
+ */
+#define MASK_REGULAR (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO)
+#define MASK_SPECIAL (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_CTIME)
+#define MASK_UNKNOWN (MASK_REGULAR | MASK_SPECIAL)
+#define MASK_CHANGED (STATX_MODE | STATX_SIZE | STATX_MTIME)
+
+static void statx_to_stat(const struct statx* stx, struct stat* s)
+{
+   memset(s, 0, sizeof(*s));
+   s->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+   s->st_ino = stx->stx_ino;
+   s->st_mode = stx->stx_mode;
+   s->st_nlink = stx->stx_nlink;
+   s->st_uid = stx->stx_uid;
+   s->st_gid = stx->stx_gid;
+   s->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+   s->st_size = stx->stx_size;
+   s->st_blksize = stx->stx_blksize;
+   s->st_blocks = stx->stx_blocks;
+   s->st_atim.tv_sec = stx->stx_atime.tv_sec;
+   s->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+   s->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+   s->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+   s->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+   s->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/**
+ * statx() into a struct stat. Fields not in mask are left zero.
+ */
+static int stat_at(int dirfd, const char* name, int flags, unsigned mask,
+		   struct stat* s)
+{
+   struct statx stx;
+
+   if (statx(dirfd, name, flags, mask, &stx) < 0)
+      return -1;
+
+   statx_to_stat(&stx, s);
+   return 0;
+}
+
+/**
+ * statx() flags for a filesystem. Network filesystems are told not to
+ * revalidate cached attributes with the server.
+ */
+static int statx_flags(int fd)
+{
+   struct statfs fs;
+
+   if (fstatfs(fd, &fs) < 0)
+      return AT_STATX_SYNC_AS_STAT;
+
+   switch ((unsigned long)fs.f_type)
+   {
+   case 0x6969:		/* NFS */
+   case 0x517b:		/* SMB */
+   case 0xff534d42:	/* CIFS */
+   case 0xfe534d42:	/* SMB2 */
+   case 0x00c36400:	/* Ceph */
+   case 0x5346414f:	/* AFS */
+   case 0x01021997:	/* 9p */
+   case 0x0bd00bd0:	/* Lustre */
+   case 0x65735546:	/* FUSE */
+      return AT_STATX_DONT_SYNC;
+   }
+
+   return AT_STATX_SYNC_AS_STAT;
+}
+
+/**
+ * Whether a filesystem only keeps whole seconds of file times, so that
+ * copies there lose the nanoseconds of the source.
+ */
+static bool whole_seconds(int fd)
+{
+   struct statfs fs;
+
+   if (fstatfs(fd, &fs) < 0)
+      return false;
+
+   switch ((unsigned long)fs.f_type)
+   {
+   case 0x4d44:		/* FAT */
+   case 0x2011bab0:	/* exFAT */
+   case 0x4244:		/* HFS */
+   case 0x482b:		/* HFS+ */
+   case 0x9660:		/* ISO 9660 */
+      return true;
+   }
+
+   return false;
+}
+
+/**
+ * Whether a file differs from its copy in the previous backup. Times
+ * are compared to the nanosecond unless the previous backup's
+ * filesystem only keeps whole seconds.
+ */
+static inline bool file_changed(const struct stat* s, const struct stat* prev,
+				bool seconds)
+{
+   return s->st_size != prev->st_size ||
+      s->st_mtim.tv_sec != prev->st_mtim.tv_sec ||
+      (!seconds && s->st_mtim.tv_nsec != prev->st_mtim.tv_nsec);
+}
+
 /**
  * Find the previous incremental backup under the root dest path.
  */
@@ -195,30 +463,46 @@ static char* locate_previous(const char* root)
 }
 
 /**
- * Set stat time, permissions, and ownership on file.
+ * Path of the manifest kept next to a backup directory.
+ */
+static char* manifest_file(const char* backup)
+{
+   char* result = (char*)malloc(strlen(backup) + sizeof(MANIFEST_SUFFIX));
+
+   if (result)
+   {
+      strcpy(result,backup);
+      strcat(result,MANIFEST_SUFFIX);
+   }
+
+   return result;
+}
+
+/**
+ * Set stat time, permissions, and ownership on an open file.
  */
-bool copy_time(const char* file, struct stat* s)
+bool copy_time(int fd, const char* file, struct stat* s)
 {
    bool result = true;
-   struct utimbuf times;
+   struct timespec times[2];
 
-   times.actime = s->st_atime;
-   times.modtime = s->st_mtime;
+   times[0] = s->st_atim;
+   times[1] = s->st_mtim;
 
-   if (utime(file, &times) < 0)
+   if (futimens(fd, times) < 0)
    {
       err("could not set time on %s", file);
       result = false;
    }
 
-   if (chown(file, s->st_uid, s->st_gid) < 0)
+   if (fchown(fd, s->st_uid, s->st_gid) < 0)
    {
       err("could not set ownership on %s", file);
       s->st_mode &= ~(S_ISUID | S_ISGID);
       result = false;
    }
 
-   if (chmod(file, s->st_mode) < 0)
+   if (fchmod(fd, s->st_mode) < 0)
    {
       err("could not set permissions on %s", file);
       result = false;
@@ -228,210 +512,3924 @@ bool copy_time(const char* file, struct stat* s)
 }
 
 /**
- * Simple file copy with mode to set on new file.
+ * Kernel copy methods, in order of preference.
  */
-bool copy_file(const char* source, const char* dest, struct stat* s)
+enum copy_method
 {
-   bool result = true;
+   COPY_RANGE,
+   COPY_URING,
+   COPY_SENDFILE,
+   COPY_READWRITE
+};
 
-   info("copy %s ...",dest);
+/**
+ * Best known copy method for a source/destination filesystem pair.
+ */
+struct fs_pair
+{
+   dev_t source;
+   dev_t dest;
+   enum copy_method method;
+   bool no_reflink;
+   struct fs_pair* next;
+};
 
-   int in = open(source, O_RDONLY);
-   if (in == -1)
-   {
-      err("unable to open `%s'", source);
-      result = false;
-      goto done;
-   }
+static struct fs_pair* fs_pairs = NULL;
+static pthread_mutex_t fs_pairs_lock = PTHREAD_MUTEX_INITIALIZER;
 
-   int out = open(dest, O_WRONLY|O_CREAT, s->st_mode);
-   if (out == -1)
+static struct fs_pair* lookup_fs_pair(dev_t source, dev_t dest)
+{
+   struct fs_pair* pair;
+
+   pthread_mutex_lock(&fs_pairs_lock);
+
+   for (pair = fs_pairs; pair; pair = pair->next)
+      if (pair->source == source && pair->dest == dest)
+	 goto done;
+
+   pair = (struct fs_pair*)malloc(sizeof(*pair));
+   if (pair)
    {
-      err("unable to open `%s'", dest);
-      result = false;
-      goto done;
+      pair->source = source;
+      pair->dest = dest;
+      pair->method = COPY_RANGE;
+      pair->no_reflink = false;
+      pair->next = fs_pairs;
+      fs_pairs = pair;
    }
 
-   char* buffer = (char*)malloc(s->st_blksize);
+ done:
+   pthread_mutex_unlock(&fs_pairs_lock);
+   return pair;
+}
 
-   if (!buffer)
+/**
+ * Remember that the filesystems of a pair cannot clone.
+ */
+static void set_no_reflink(struct fs_pair* pair)
+{
+   if (pair)
    {
-      result = false;
+      pthread_mutex_lock(&fs_pairs_lock);
+      pair->no_reflink = true;
+      pthread_mutex_unlock(&fs_pairs_lock);
    }
+}
+
+/**
+ * Errors that mean a kernel copy method does not work between two
+ * files, as opposed to a real I/O error.
+ */
+static inline bool copy_unsupported(int error)
+{
+   return error == ENOSYS || error == EXDEV || error == EINVAL ||
+      error == EOPNOTSUPP || error == ENOTSUP || error == EBADF;
+}
+
+/**
+ * Share the data blocks of in with out on a copy-on-write filesystem.
+ *
+ * @return 1 if cloned, 0 if the filesystems cannot clone and -1 on error.
+ */
+static int clone_file(int in, int out)
+{
+   if (ioctl(out, FICLONE, in) == 0)
+      return 1;
+
+   return (copy_unsupported(errno) || errno == ETXTBSY) ? 0 : -1;
+}
+
+/**
+ * Whether ranges of in can be shared with the empty file out, tried with
+ * the first block of in and remembered per pair of filesystems when they
+ * cannot. out is left empty.
+ *
+ * @return 1 if they can, 0 if not and -1 on error.
+ */
+static int clone_range_works(int in, int out)
+{
+   struct stat in_stat;
+   struct stat out_stat;
+   struct fs_pair* pair = NULL;
+   int result = 0;
+
+   if (reflink == REFLINK_NEVER || fstat(in, &in_stat) < 0 ||
+       fstat(out, &out_stat) < 0)
+      return 0;
+
+   pair = lookup_fs_pair(in_stat.st_dev, out_stat.st_dev);
+   if (pair && pair->no_reflink)
+      return 0;
+
+   /* a range that ends at the end of in needs no alignment */
+   struct file_clone_range range;
+
+   memset(&range, 0, sizeof(range));
+   range.src_fd = in;
+   range.src_length = in_stat.st_size < 4096 ? in_stat.st_size : 4096;
+
+   if (ioctl(out, FICLONERANGE, &range) == 0)
+      result = 1;
+   else if (!copy_unsupported(errno) && errno != ETXTBSY)
+      return -1;
    else
-   {
-      ssize_t bytes = 0;
+      set_no_reflink(pair);
 
-      while((bytes = read(in, buffer, sizeof(buffer))) > 0)
-      {
-	 if (write(out, buffer, bytes) != bytes)
-	 {
-	    err("incomplete copy of file %s", source);
-	    result = false;
-	    break;
-	 }
-      }
-   }
+   if (result && ftruncate(out, 0) < 0)
+      return -1;
 
-done:
-   close(in);
-   close(out);
-   free(buffer);
    return result;
 }
 
 /**
- * Create a symlink. However, if the source is already a symlink,
- * use that symlink's source as the source, not the symlink itself.
- * We have to do this to prevent running into the nested symlink
- * limitation.
+ * pace_writeback() for the part of fd written from start on, leaving the
+ * rest of the file to whoever writes it.
  */
-static inline bool symlink_file(const char* source, const char* dest)
+static void pace_range(int fd, off_t start, off_t from, off_t to)
 {
-   char buffer[PATH_MAX+1];
-   struct stat s;
+   off_t done;
 
-   memset(buffer,0,sizeof(buffer));
+   if (!writeback_window || from / writeback_window == to / writeback_window)
+      return;
+
+   done = to / writeback_window * writeback_window;
+   sync_file_range(fd, start, done - start, SYNC_FILE_RANGE_WRITE);
 
-   if (lstat(source, &s) < 0)
+   if (done - start > writeback_window)
    {
-      err("could not stat %s", source);
-      return false;
+      done -= writeback_window;
+      sync_file_range(fd, start, done - start, SYNC_FILE_RANGE_WAIT_BEFORE |
+		      SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      if (nocache)
+	 posix_fadvise(fd, start, done - start, POSIX_FADV_DONTNEED);
    }
+}
 
-   if (S_ISLNK(s.st_mode))
+/**
+ * Pace the writeback of a copy for --writeback. Each window that has
+ * been written completely is sent to disk right away and the ones
+ * before it are waited for, so a copy has at most about two windows of
+ * dirty pages and all copies together no more than that per job.
+ *
+ * @param from Offset of fd before the last write.
+ * @param to Offset of fd after the last write.
+ */
+static void pace_writeback(int fd, off_t from, off_t to)
+{
+   pace_range(fd, 0, from, to);
+}
+
+/**
+ * Copy from the current offset of in to the current offset of out
+ * without passing the data through user memory.
+ *
+ * @return 1 on EOF, 0 if the method is not supported (nothing more
+ * was copied) and -1 on error.
+ */
+static int copy_kernel(int in, int out, enum copy_method method, off_t* copied)
+{
+   /* with --writeback, stop at each window to pace it */
+   const size_t chunk = writeback_window && writeback_window < (1 << 30) ?
+      writeback_window : 1 << 30;
+   off_t offset = writeback_window ? lseek(out, 0, SEEK_CUR) : 0;
+   ssize_t bytes;
+
+   for (;;)
    {
-      if (readlink(source,buffer,PATH_MAX) == -1)
-      {
-	 err("cannot read symlink `%s'", source);
-	 return false;
-      }
+      if (method == COPY_RANGE)
+	 bytes = copy_file_range(in, NULL, out, NULL, chunk, 0);
       else
+	 bytes = sendfile(out, in, NULL, chunk);
+
+      if (bytes == 0)
+	 return 1;
+
+      if (bytes < 0)
       {
-	 source = buffer;
+	 if (errno == EINTR)
+	    continue;
+	 return copy_unsupported(errno) ? 0 : -1;
       }
+
+      *copied += bytes;
+      pace_writeback(out, offset, offset + bytes);
+      offset += bytes;
    }
+}
 
-   info("mirror %s ...",source);
+/**
+ * Size of the copy buffer for a file. Small files are read in one go,
+ * everything else with MAX_BUFFER_SIZE, always in whole device blocks.
+ */
+static size_t copy_buffer_size(struct stat* s)
+{
+   size_t block = s->st_blksize > 0 ? s->st_blksize : BUFFER_ALIGN;
+   size_t size;
 
-   return symlink(source, dest) == 0;
+   if (buffer_size)
+      return buffer_size;
+
+   size = s->st_size < MAX_BUFFER_SIZE ? s->st_size : MAX_BUFFER_SIZE;
+   size = (size + block - 1) / block * block;
+
+   return size ? size : block;
 }
 
-static const char* current_time(const char* format)
+/**
+ * Per thread copy buffer, grown as needed and reused between files.
+ */
+static __thread char* copy_buffer = NULL;
+static __thread size_t copy_buffer_len = 0;
+
+static char* get_copy_buffer(size_t size)
 {
-   static char date[1024];
-   time_t now;
-   struct tm tnow;
-   time(&now);
-   tnow = *localtime(&now);
-   strftime(date,32,format,&tnow);
-   return date;
+   if (size > copy_buffer_len)
+   {
+      void* buffer;
+
+      if (posix_memalign(&buffer, BUFFER_ALIGN, size))
+	 return NULL;
+
+      free(copy_buffer);
+      copy_buffer = (char*)buffer;
+      copy_buffer_len = size;
+   }
+
+   return copy_buffer;
 }
 
+#ifdef HAVE_IO_URING
 /**
- * Process a file (or directory, or symlink, etc).
- *
- * @param source Complete path to the source file.
- * @param root Path to the backup destination directory.
- * @param prev Optional path to a previous backup destination directory.
+ * Per thread io_uring, set up on first use when --io-uring is given.
  */
-bool process_file(const char* source, const char* root, const char* prev_root)
+static __thread struct uring* thread_ring = NULL;
+static __thread bool thread_ring_failed = false;
+
+static struct uring* get_ring(void)
 {
-   bool result = true;
-   struct stat source_stat;
+   if (!use_uring || thread_ring || thread_ring_failed)
+      return thread_ring;
 
-   if (lstat(source, &source_stat) < 0)
+   struct uring* ring = (struct uring*)malloc(sizeof(*ring));
+
+   if (!ring || !uring_init(ring, URING_DEPTH))
    {
-      err("could not stat file %s", source);
-      result = false;
+      info("io_uring not available, using synchronous I/O");
+      free(ring);
+      thread_ring_failed = true;
+      return NULL;
    }
-   else
-   {
-      if (exclude_pattern && !fnmatch(exclude_pattern,source,0))
-	 return true;
 
-      /* destination file */
-      char* dest = join_path(root,source);
+   thread_ring = ring;
+   return ring;
+}
 
-      /* optional previous file path */
-      char* prev_dest = prev_root ? join_path(prev_root,source) : NULL;
+/**
+ * Tear down the thread's ring after a failed submission. Entries that
+ * were queued but not submitted are discarded with it.
+ */
+static void drop_ring(void)
+{
+   info("io_uring submission failed, using synchronous I/O");
+   uring_exit(thread_ring);
+   free(thread_ring);
+   thread_ring = NULL;
+   thread_ring_failed = true;
+}
 
-      if (S_ISDIR(source_stat.st_mode))
-      {
-	 mode_t saved_umask = umask(0);
-	 mode_t mode = source_stat.st_mode |= S_IRWXU;
+/**
+ * Copy from the current offset of in to out with linked read and write
+ * requests for up to URING_COPY_SLOTS buffers in flight. Used one file
+ * at a time, for files past SMALL_FILE where copy_file_range() does not
+ * work between the filesystems or may not clone; opening and closing stay
+ * synchronous.
+ *
+ * @return 1 when done and 0 if the rest has to be copied another way,
+ * with both offsets moved to the first byte not copied.
+ */
+static int copy_uring(int in, int out, struct stat* s, off_t* copied)
+{
+   struct uring* ring = get_ring();
+   off_t start = lseek(in, 0, SEEK_CUR);
+   off_t end = s->st_size;
 
-	 if (rmkdir(dest, mode) < 0)
-	 {
-	    err("cannot create directory %s", dest);
-	    umask(saved_umask);
-	    result = false;
-	 }
-	 else
-	 {
-	    umask(saved_umask);
+   if (!ring || start < 0 || lseek(out, start, SEEK_SET) < 0 || start >= end)
+      return 0;
 
-	    DIR* dir = opendir(source);
+   size_t chunk = copy_buffer_size(s);
+   size_t slots = (end - start + chunk - 1) / chunk;
 
-	    if (!dir)
-	    {
-	       err("could not open directory %s", source);
-	       result = false;
-	    }
-	    else
-	    {
-	       struct dirent* entry;
-	       while ((entry = readdir(dir)) && result)
-	       {
-		  if (ignore_dir(entry->d_name))
-		     continue;
+   if (slots > URING_COPY_SLOTS)
+      slots = URING_COPY_SLOTS;
 
-		  char* new_source = join_path(source,entry->d_name);
+   char* buffer = get_copy_buffer(chunk * slots);
+   off_t offsets[URING_COPY_SLOTS];
+   bool fresh[URING_COPY_SLOTS];
+   off_t next = start;
+   /* everything below has been written */
+   off_t written = start;
+   off_t bad = end;
+   size_t inflight = 0;
+   bool broken = false;
+   size_t x;
 
-		  result = process_file(new_source, root, prev_root);
+   if (!buffer)
+      return 0;
 
-		  free(new_source);
-	       }
-	       closedir(dir);
-	    }
+   for (x = 0; x < slots; x++)
+      offsets[x] = -1;
 
-	    if (result && chmod(dest, source_stat.st_mode & ~saved_umask) < 0)
-	    {
-	       err("unable to change permissions of `%s'", dest);
-	       result = false;
-	    }
-	    else if (result)
-	    {
-	       result = copy_time(dest,&source_stat);
-	    }
+   for (;;)
+   {
+      size_t queued = 0;
+
+      /* refill free slots while nothing has gone wrong */
+      for (x = 0; x < slots; x++)
+      {
+	 fresh[x] = false;
+
+	 if (offsets[x] >= 0 || next >= end || bad < end)
+	    continue;
+
+	 /* the queue is drained every round and has room for all slots */
+	 size_t len = end - next < (off_t)chunk ? end - next : chunk;
+	 struct io_uring_sqe* read_sqe = uring_get_sqe(ring);
+	 struct io_uring_sqe* write_sqe = uring_get_sqe(ring);
+
+	 uring_prep_read(read_sqe, in, buffer + x * chunk, len, next);
+	 read_sqe->flags |= IOSQE_IO_LINK;
+	 read_sqe->user_data = x * 2;
+	 uring_prep_write(write_sqe, out, buffer + x * chunk, len, next);
+	 write_sqe->user_data = x * 2 + 1;
+
+	 offsets[x] = next;
+	 fresh[x] = true;
+	 next += len;
+	 queued += 2;
+      }
+
+      int submitted = queued ? uring_submit(ring, 0) : 0;
+
+      if (submitted < (int)queued)
+      {
+	 size_t taken = submitted > 0 ? submitted : 0;
+	 size_t sqe = 0;
+
+	 /*
+	  * Entries go to the kernel in the order queued: wait only for
+	  * the slots whose read was taken, a read without its write
+	  * still completes.
+	  */
+	 for (x = 0; x < slots; x++)
+	 {
+	    if (!fresh[x])
+	       continue;
+	    if (offsets[x] < bad)
+	       bad = offsets[x];
+	    if (sqe >= taken)
+	       offsets[x] = -1;
+	    sqe += 2;
+	 }
+	 queued = taken;
+	 broken = true;
+      }
+
+      inflight += queued;
+
+      if (!inflight)
+	 break;
+
+      struct io_uring_cqe cqe;
+      bool wait = true;
+
+      while (inflight && uring_next_cqe(ring, &cqe, wait))
+      {
+	 wait = false;
+
+	 x = cqe.user_data / 2;
+	 inflight--;
+
+	 off_t len = end - offsets[x] < (off_t)chunk ? end - offsets[x] : (off_t)chunk;
+
+	 if (cqe.res != len)
+	 {
+	    if (offsets[x] < bad)
+	       bad = offsets[x];
+	 }
+
+	 if (cqe.user_data & 1)
+	 {
+	    if (cqe.res == len)
+	       *copied += len;
+	    offsets[x] = -1;
+	 }
+      }
+
+      if (writeback_window)
+      {
+	 off_t frontier = next;
+
+	 for (x = 0; x < slots; x++)
+	    if (offsets[x] >= 0 && offsets[x] < frontier)
+	       frontier = offsets[x];
+
+	 if (frontier > bad)
+	    frontier = bad;
+
+	 pace_writeback(out, written, frontier);
+	 written = frontier;
+      }
+   }
+
+   if (broken)
+      drop_ring();
+
+   if (bad < end)
+   {
+      if (ftruncate(out, bad) < 0)
+	 return -1;
+   }
+
+   lseek(in, bad, SEEK_SET);
+   lseek(out, bad, SEEK_SET);
+
+   return bad == end ? 1 : 0;
+}
+#endif
+
+/**
+ * Free the calling thread's copy buffer and ring.
+ */
+static void thread_cleanup(void)
+{
+   free(copy_buffer);
+   copy_buffer = NULL;
+   copy_buffer_len = 0;
+
+#ifdef HAVE_IO_URING
+   if (thread_ring)
+   {
+      uring_exit(thread_ring);
+      free(thread_ring);
+      thread_ring = NULL;
+   }
+#endif
+}
+
+/**
+ * Open a source file for reading. With --nocache its access time is
+ * left alone where the file's owner allows it.
+ */
+static int open_source(int dir, const char* name)
+{
+   if (nocache)
+   {
+      int fd = openat(dir, name, O_RDONLY|O_NOFOLLOW|O_NOATIME);
+
+      if (fd != -1 || errno != EPERM)
+	 return fd;
+   }
+
+   return openat(dir, name, O_RDONLY|O_NOFOLLOW);
+}
+
+/**
+ * Take a copied file out of the page cache for --nocache. The pages of
+ * the copy can only go once written back, so that is waited for. Either
+ * descriptor may be -1 when there is only a file read or only one
+ * written.
+ */
+static void drop_cache(int in, int out)
+{
+   posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+
+   if (sync_file_range(out, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+		       SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+      posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * Plain read()/write() copy loop, the last resort. With --nocache the
+ * next buffer is read ahead and the source pages already copied are
+ * dropped.
+ *
+ * @param hash If not NULL, the data copied is added to it.
+ */
+static bool copy_readwrite(int in, int out, const char* source, struct stat* s,
+			   struct sha256* hash)
+{
+   size_t size = copy_buffer_size(s);
+   char* buffer = get_copy_buffer(size);
+   off_t offset = nocache || writeback_window ? lseek(in, 0, SEEK_CUR) : -1;
+   ssize_t bytes;
+
+   if (!buffer)
+   {
+      err("out of memory copying %s", source);
+      return false;
+   }
+
+   while ((bytes = read(in, buffer, size)) != 0)
+   {
+      if (bytes < 0)
+      {
+	 if (errno == EINTR)
+	    continue;
+	 err("unable to read `%s'", source);
+	 return false;
+      }
+
+      if (offset >= 0 && nocache)
+      {
+	 posix_fadvise(in, offset + bytes, size, POSIX_FADV_WILLNEED);
+	 posix_fadvise(in, offset, bytes, POSIX_FADV_DONTNEED);
+      }
+
+      if (hash)
+	 sha256_update(hash, buffer, bytes);
+
+      char* p = buffer;
+      off_t from = offset;
+
+      if (offset >= 0)
+	 offset += bytes;
+
+      while (bytes > 0)
+      {
+	 ssize_t written = write(out, p, bytes);
+
+	 if (written < 0 && errno == EINTR)
+	    continue;
+
+	 if (written <= 0)
+	 {
+	    err("incomplete copy of file %s", source);
+	    return false;
+	 }
+
+	 p += written;
+	 bytes -= written;
+      }
+
+      if (from >= 0)
+	 pace_writeback(out, from, offset);
+   }
+
+   return true;
+}
+
+/**
+ * write() all of data, retrying short writes.
+ */
+static bool write_all(int fd, const unsigned char* data, size_t len)
+{
+   while (len)
+   {
+      ssize_t written = write(fd, data, len);
+
+      if (written < 0 && errno == EINTR)
+	 continue;
+
+      if (written <= 0)
+	 return false;
+
+      data += written;
+      len -= written;
+   }
+
+   return true;
+}
+
+/**
+ * Copy len bytes at offset of in to the current offset of out, in the
+ * kernel when possible. copy_file_range() may clone on the same
+ * filesystem, so it is not used with --reflink=never.
+ */
+static bool copy_range(int in, off_t offset, size_t len, int out)
+{
+   off_t at = writeback_window ? lseek(out, 0, SEEK_CUR) : 0;
+
+   while (len && reflink != REFLINK_NEVER)
+   {
+      size_t n = writeback_window && (off_t)len > writeback_window ?
+	 (size_t)writeback_window : len;
+      ssize_t bytes = copy_file_range(in, &offset, out, NULL, n, 0);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      if (bytes <= 0)
+	 break;
+
+      len -= bytes;
+      pace_writeback(out, at, at + bytes);
+      at += bytes;
+   }
+
+   /* copy what is left by hand */
+   char* buffer = len ? get_copy_buffer(MAX_BUFFER_SIZE) : NULL;
+
+   while (len)
+   {
+      size_t n = len < MAX_BUFFER_SIZE ? len : MAX_BUFFER_SIZE;
+      ssize_t bytes = pread(in, buffer, n, offset);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      if (!buffer || bytes <= 0 || !write_all(out, (unsigned char*)buffer, bytes))
+	 return false;
+
+      pace_writeback(out, at, at + bytes);
+      at += bytes;
+      offset += bytes;
+      len -= bytes;
+   }
+
+   return true;
+}
+
+/**
+ * Whether a block is all zeros. Comparing the block with itself shifted
+ * lets the vectorized memcmp() do the scanning.
+ */
+static inline bool is_zero(const char* data, size_t len)
+{
+   size_t head = len < 16 ? len : 16;
+   size_t x;
+
+   for (x = 0; x < head; x++)
+      if (data[x])
+	 return false;
+
+   return len <= 16 || !memcmp(data, data + 16, len - 16);
+}
+
+/**
+ * Copy len bytes at offset of in to the same offset of out, skipping
+ * over the ZERO_BLOCK blocks that are all zeros.
+ */
+static bool copy_zeros(int in, off_t offset, off_t len, int out)
+{
+   char* buffer = get_copy_buffer(MAX_BUFFER_SIZE);
+
+   if (!buffer)
+      return false;
+
+   while (len)
+   {
+      ssize_t bytes = pread(in, buffer, len < MAX_BUFFER_SIZE ? len : MAX_BUFFER_SIZE,
+			    offset);
+      ssize_t x = 0;
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      if (bytes <= 0)
+	 return false;
+
+      /* write each run of blocks with data in one go */
+      while (x < bytes)
+      {
+	 ssize_t start;
+
+	 for (; x < bytes; x += ZERO_BLOCK)
+	    if (!is_zero(buffer + x, bytes - x < ZERO_BLOCK ? bytes - x : ZERO_BLOCK))
+	       break;
+
+	 for (start = x; x < bytes; x += ZERO_BLOCK)
+	    if (is_zero(buffer + x, bytes - x < ZERO_BLOCK ? bytes - x : ZERO_BLOCK))
+	       break;
+
+	 if (x > bytes)
+	    x = bytes;
+
+	 if (x > start && (lseek(out, offset + start, SEEK_SET) < 0 ||
+			   !write_all(out, (unsigned char*)buffer + start, x - start)))
+	    return false;
+      }
+
+      offset += bytes;
+      len -= bytes;
+   }
+
+   return true;
+}
+
+/**
+ * Copy only the data extents of a sparse file, leaving its holes as
+ * holes in the copy. With --sparse=always zeroed blocks within the
+ * extents become holes as well.
+ *
+ * @return 1 if copied, 0 if the filesystem cannot tell where the holes
+ * are (nothing was copied) and -1 on error.
+ */
+static int copy_sparse(int in, int out, struct stat* s)
+{
+   bool zeros = sparse == SPARSE_ALWAYS;
+   bool seek = true;
+   off_t data = lseek(in, 0, SEEK_DATA);
+   off_t hole;
+
+   if (data < 0 && errno != ENXIO)
+   {
+      if (!copy_unsupported(errno))
+	 return -1;
+      if (!zeros)
+	 return 0;
+
+      /* the whole file is one extent to look for zeros in */
+      seek = false;
+      data = 0;
+   }
+
+   /* ENXIO means there is no data at all */
+   while (data >= 0 && data < s->st_size)
+   {
+      if (!seek)
+	 hole = s->st_size;
+      else if ((hole = lseek(in, data, SEEK_HOLE)) < 0)
+	 return -1;
+
+      if (hole > s->st_size)
+	 hole = s->st_size;
+
+      if (zeros)
+      {
+	 if (!copy_zeros(in, data, hole - data, out))
+	    return -1;
+      }
+      else if (lseek(out, data, SEEK_SET) < 0 ||
+	       !copy_range(in, data, hole - data, out))
+	 return -1;
+
+      if (!seek)
+	 break;
+
+      if ((data = lseek(in, hole, SEEK_DATA)) < 0 && errno != ENXIO)
+	 return -1;
+   }
+
+   return ftruncate(out, s->st_size) == 0 ? 1 : -1;
+}
+
+/**
+ * A file copied by several threads, each taking the next SPLIT_RANGE
+ * bytes until there are none left. The copy workers that help out may
+ * only get to it after the file is done, so it is freed by whoever
+ * drops the last reference.
+ */
+struct split_copy
+{
+   int in;
+   int out;
+   off_t size;
+   /* start of the next range */
+   off_t next;
+   /* ranges being copied */
+   int running;
+   int refs;
+   bool failed;
+   pthread_mutex_t lock;
+   pthread_cond_t idle;
+};
+
+static bool submit_split(struct split_copy* copy);
+
+/**
+ * Copy len bytes at offset of in to the same offset of out without
+ * touching the file offsets, so other threads can copy other ranges.
+ */
+static bool copy_at(int in, int out, off_t offset, off_t len)
+{
+   loff_t in_offset = offset;
+   loff_t out_offset = offset;
+   off_t start = offset;
+
+   while (len && reflink != REFLINK_NEVER)
+   {
+      size_t n = writeback_window && len > writeback_window ?
+	 (size_t)writeback_window : (size_t)len;
+      ssize_t bytes = copy_file_range(in, &in_offset, out, &out_offset, n, 0);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      /* EOF, the file shrank */
+      if (bytes == 0)
+	 return true;
+
+      if (bytes < 0)
+      {
+	 if (!copy_unsupported(errno))
+	    return false;
+	 break;
+      }
+
+      len -= bytes;
+      pace_range(out, start, out_offset - bytes, out_offset);
+   }
+
+   char* buffer = len ? get_copy_buffer(MAX_BUFFER_SIZE) : NULL;
+
+   offset = in_offset;
+   while (len)
+   {
+      ssize_t bytes = pread(in, buffer, len < MAX_BUFFER_SIZE ? len : MAX_BUFFER_SIZE,
+			    offset);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      if (bytes == 0)
+	 return true;
+
+      if (!buffer || bytes < 0 || pwrite(out, buffer, bytes, offset) != bytes)
+	 return false;
+
+      pace_range(out, start, offset, offset + bytes);
+      offset += bytes;
+      len -= bytes;
+   }
+
+   return true;
+}
+
+/**
+ * Copy ranges of a split file until there are none left.
+ */
+static void split_run(struct split_copy* copy)
+{
+   pthread_mutex_lock(&copy->lock);
+
+   while (copy->next < copy->size && !copy->failed)
+   {
+      off_t offset = copy->next;
+      off_t len = copy->size - offset < SPLIT_RANGE ? copy->size - offset : SPLIT_RANGE;
+
+      copy->next += len;
+      copy->running++;
+      pthread_mutex_unlock(&copy->lock);
+
+      bool done = copy_at(copy->in, copy->out, offset, len);
+
+      pthread_mutex_lock(&copy->lock);
+      if (!done)
+	 copy->failed = true;
+      if (!--copy->running)
+	 pthread_cond_broadcast(&copy->idle);
+   }
+
+   pthread_mutex_unlock(&copy->lock);
+}
+
+static void split_release(struct split_copy* copy)
+{
+   if (__atomic_sub_fetch(&copy->refs, 1, __ATOMIC_ACQ_REL))
+      return;
+
+   pthread_mutex_destroy(&copy->lock);
+   pthread_cond_destroy(&copy->idle);
+   free(copy);
+}
+
+/**
+ * Copy a file with up to --jobs threads, each copying different ranges
+ * of it. The other threads are copy workers picking up the split before
+ * their next file; no more threads are started. Returns once every range
+ * has been copied, so the caller can finish the file.
+ */
+static bool copy_split(int in, int out, struct stat* s)
+{
+   struct split_copy* copy = (struct split_copy*)calloc(1, sizeof(*copy));
+   off_t ranges = (s->st_size + SPLIT_RANGE - 1) / SPLIT_RANGE;
+   int helpers = (ranges < jobs ? ranges : jobs) - 1;
+   bool result;
+
+   if (!copy)
+      return copy_at(in, out, 0, s->st_size);
+
+   copy->in = in;
+   copy->out = out;
+   copy->size = s->st_size;
+   copy->refs = 1;
+   pthread_mutex_init(&copy->lock, NULL);
+   pthread_cond_init(&copy->idle, NULL);
+
+   /* the calling thread is one of them, and fewer threads also do */
+   while (helpers-- > 0 && submit_split(copy))
+      ;
+
+   split_run(copy);
+
+   /* ranges other threads took may still be in progress */
+   pthread_mutex_lock(&copy->lock);
+   while (copy->running)
+      pthread_cond_wait(&copy->idle, &copy->lock);
+   result = !copy->failed;
+   pthread_mutex_unlock(&copy->lock);
+
+   split_release(copy);
+   return result;
+}
+
+/**
+ * Add bytes offset to end of a file to a hash.
+ */
+static bool hash_range(int fd, const char* file, off_t offset, off_t end,
+		       struct sha256* ctx)
+{
+   char* buffer = get_copy_buffer(MAX_BUFFER_SIZE);
+
+   if (!buffer)
+   {
+      err("out of memory hashing %s", file);
+      return false;
+   }
+
+   while (offset < end)
+   {
+      ssize_t bytes = pread(fd, buffer, end - offset < MAX_BUFFER_SIZE ?
+			    end - offset : MAX_BUFFER_SIZE, offset);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      if (bytes <= 0)
+      {
+	 err("unable to read `%s'", file);
+	 return false;
+      }
+
+      sha256_update(ctx, buffer, bytes);
+
+      if (nocache)
+	 posix_fadvise(fd, offset, bytes, POSIX_FADV_DONTNEED);
+
+      offset += bytes;
+   }
+
+   return true;
+}
+
+/**
+ * Simple file copy of name from the source to the destination directory,
+ * setting the stat information of the new file when done. s is refreshed
+ * from the opened source file.
+ *
+ * Depending on --reflink the file is first cloned with FICLONE.
+ * Otherwise the data is moved with copy_file_range() or sendfile() when
+ * the kernel supports it for this pair of filesystems, falling back to
+ * read()/write(). copy_file_range() may clone too, so --reflink=never
+ * starts at the next method. The method that works is remembered per pair. Sparse
+ * files have only their data extents copied, unless --sparse=never, and
+ * with --sparse=always blocks of zeros are left out too. Other large
+ * files are preallocated, and with --split the biggest are copied by
+ * several threads. Files up to SMALL_FILE take a single read() and
+ * write().
+ *
+ * When the data is to be hashed as well, it goes through read()/write()
+ * and is hashed on the way. A clone or a sparse copy does not pass it
+ * through here, so then the source is read once more for the hash.
+ *
+ * @param dest_name Name of the copy in dest_dir.
+ * @param source Path of the source file, for messages.
+ * @param hash If not NULL, the data copied is added to it.
+ */
+bool copy_file(int source_dir, int dest_dir, const char* name,
+	       const char* dest_name, const char* source, struct stat* s,
+	       struct sha256* hash)
+{
+   bool result = true;
+   /* the data went through hash while it was copied */
+   bool hashed = false;
+   int out = -1;
+
+   info("copy %s ...",source);
+
+   int in = open_source(source_dir, name);
+   if (in == -1 || fstat(in, s) < 0)
+   {
+      err("unable to open `%s'", source);
+      result = false;
+      goto done;
+   }
+
+   if (nocache)
+      posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+   /*
+    * Small files are read whole into the thread's copy buffer, one byte
+    * more than expected to see the end, and written in one go. Cloning
+    * and the kernel copy paths would take more syscalls than the data
+    * is worth, and a hole in them would not save anything.
+    */
+   char* small = NULL;
+   ssize_t small_len = -1;
+
+   if (s->st_size <= SMALL_FILE && reflink != REFLINK_ALWAYS &&
+       sparse != SPARSE_ALWAYS && (small = get_copy_buffer(SMALL_FILE + 1)))
+   {
+      while ((small_len = read(in, small, SMALL_FILE + 1)) < 0 && errno == EINTR)
+	 ;
+
+      /* it grew, or could not be read, so take the usual way */
+      if (small_len < 0 || small_len > SMALL_FILE)
+      {
+	 small_len = -1;
+	 if (lseek(in, 0, SEEK_SET) < 0)
+	 {
+	    err("unable to read `%s'", source);
+	    result = false;
+	    goto done;
+	 }
+      }
+   }
+
+   out = openat(dest_dir, dest_name, O_WRONLY|O_CREAT|O_TRUNC, s->st_mode);
+   if (out == -1)
+   {
+      err("unable to create copy of `%s'", source);
+      result = false;
+      goto done;
+   }
+
+   if (small_len >= 0)
+   {
+      if (!write_all(out, (unsigned char*)small, small_len))
+      {
+	 err("incomplete copy of file %s", source);
+	 result = false;
+      }
+      if (hash)
+	 sha256_update(hash, small, small_len);
+      hashed = true;
+      goto done;
+   }
+
+   struct stat dest_stat;
+   struct fs_pair* pair = NULL;
+
+   if (fstat(out, &dest_stat) == 0)
+      pair = lookup_fs_pair(s->st_dev, dest_stat.st_dev);
+
+   if (reflink != REFLINK_NEVER && !(pair && pair->no_reflink))
+   {
+      int ret = clone_file(in, out);
+
+      if (ret > 0)
+	 goto done;
+
+      if (ret < 0 || reflink == REFLINK_ALWAYS)
+      {
+	 err("unable to clone `%s'", source);
+	 result = false;
+	 goto done;
+      }
+
+      set_no_reflink(pair);
+   }
+   else if (reflink == REFLINK_ALWAYS)
+   {
+      err("unable to clone `%s'", source);
+      result = false;
+      goto done;
+   }
+
+   /* fewer blocks than the size needs means there are holes */
+   bool holes = sparse == SPARSE_ALWAYS ||
+      (sparse == SPARSE_AUTO && (off_t)s->st_blocks * 512 < s->st_size);
+
+   /*
+    * Allocate files written in more than one go up front so they get
+    * contiguous extents, without changing the size so a short copy is
+    * not padded. Filesystems that cannot are simply left to it.
+    */
+   if (!holes && s->st_size > MAX_BUFFER_SIZE)
+      fallocate(out, FALLOC_FL_KEEP_SIZE, 0, s->st_size);
+
+   if (!holes && !hash && split_size && s->st_size >= split_size && jobs > 1)
+   {
+      info("split copy %s ...",source);
+
+      if (!copy_split(in, out, s))
+      {
+	 err("incomplete copy of file %s", source);
+	 result = false;
+      }
+      goto done;
+   }
+
+   if (holes)
+   {
+      int ret = copy_sparse(in, out, s);
+
+      if (ret > 0)
+	 goto done;
+
+      if (ret < 0)
+      {
+	 err("incomplete copy of file %s", source);
+	 result = false;
+	 goto done;
+      }
+   }
+
+   enum copy_method method = pair ? pair->method : COPY_READWRITE;
+
+   /* copy_file_range() clones on some filesystems */
+   if (reflink == REFLINK_NEVER && method == COPY_RANGE)
+      method = COPY_URING;
+
+   /* the kernel copy paths keep the data from being hashed */
+   if (hash)
+      method = COPY_READWRITE;
+
+   for (; method < COPY_READWRITE; method++)
+   {
+      off_t copied = 0;
+      int ret;
+
+      if (method == COPY_URING)
+      {
+#ifdef HAVE_IO_URING
+	 ret = copy_uring(in, out, s, &copied);
+	 if (ret > 0)
+	    goto done;
+	 if (ret < 0)
+	 {
+	    err("incomplete copy of file %s", source);
+	    result = false;
+	    goto done;
+	 }
+#endif
+	 continue;
+      }
+
+      ret = copy_kernel(in, out, method, &copied);
+
+      if (ret < 0)
+      {
+	 err("incomplete copy of file %s", source);
+	 result = false;
+	 goto done;
+      }
+
+      if (ret == 0 && pair)
+      {
+	 pthread_mutex_lock(&fs_pairs_lock);
+	 if (pair->method == method)
+	    pair->method = method + 1;
+	 pthread_mutex_unlock(&fs_pairs_lock);
+      }
+
+      /*
+       * Some pseudo filesystems report EOF to the kernel copy paths
+       * without copying anything, so let read() have a look too.
+       */
+      if (ret > 0 && copied > 0)
+	 goto done;
+   }
+
+   /* only hash on the way when nothing was copied yet */
+   hashed = hash && lseek(in, 0, SEEK_CUR) == 0;
+   result = copy_readwrite(in, out, source, s, hashed ? hash : NULL);
+
+done:
+   if (result && hash && !hashed)
+      result = hash_range(in, source, 0, s->st_size, hash);
+
+   if (result)
+      result = copy_time(out, source, s);
+
+   if (result && nocache)
+      drop_cache(in, out);
+
+   if (in != -1)
+      close(in);
+   if (out != -1)
+      close(out);
+   return result;
+}
+
+/**
+ * Create a symlink to name in the previous backup. However, if that is
+ * already a symlink, use that symlink's source as the source, not the
+ * symlink itself. We have to do this to prevent running into the nested
+ * symlink limitation.
+ *
+ * @param prev_dir Path of the previous backup directory behind prev_fd.
+ * @param flags statx() flags for the previous backup.
+ */
+static inline bool symlink_file(int prev_fd, const char* prev_dir, int flags,
+				int dest_fd, const char* name)
+{
+   char buffer[PATH_MAX+1];
+   const char* source;
+   struct stat s;
+
+   memset(buffer,0,sizeof(buffer));
+
+   if (stat_at(prev_fd, name, flags | AT_SYMLINK_NOFOLLOW, STATX_TYPE, &s) < 0)
+   {
+      err("could not stat %s/%s", prev_dir, name);
+      return false;
+   }
+
+   if (S_ISLNK(s.st_mode))
+   {
+      if (readlinkat(prev_fd,name,buffer,PATH_MAX) == -1)
+      {
+	 err("cannot read symlink `%s/%s'", prev_dir, name);
+	 return false;
+      }
+      source = buffer;
+   }
+   else
+   {
+      source = entry_path(buffer, sizeof(buffer), prev_dir, name);
+   }
+
+   info("mirror %s ...",source);
+
+   return symlinkat(source, dest_fd, name) == 0;
+}
+
+/**
+ * Hex name of a hash, fanned out into a directory by its first byte.
+ *
+ * @return the length of the name.
+ */
+static size_t hash_name(const unsigned char digest[SHA256_SIZE], char* buffer,
+			size_t size)
+{
+   size_t len = 0;
+   int x;
+
+   for (x = 0; x < SHA256_SIZE; x++)
+   {
+      len += snprintf(buffer + len, size - len, "%02x", digest[x]);
+      if (!x)
+	 buffer[len++] = '/';
+   }
+
+   return len;
+}
+
+/**
+ * Create a file of our own below a store's tmp directory for an object
+ * being written. A name left over by an earlier run is never reused.
+ *
+ * @param buffer Set to the name of the file.
+ * @return a descriptor for the new file, or -1.
+ */
+static int store_tmp_file(int fd, char* buffer, size_t size)
+{
+   for (;;)
+   {
+      snprintf(buffer, size, "tmp/%ld.%lu", (long)getpid(),
+	       __atomic_add_fetch(&store_serial, 1, __ATOMIC_RELAXED));
+
+      int tmp = openat(fd, buffer, O_WRONLY|O_CREAT|O_EXCL, 0600);
+      if (tmp != -1 || errno != EEXIST)
+	 return tmp;
+   }
+}
+
+/**
+ * Move a finished object from tmp into place under its name, creating
+ * its fan-out directory first.
+ */
+static bool store_rename(int fd, const char* tmp, char* object)
+{
+   bool result = true;
+
+   object[2] = 0;
+   if (mkdirat(fd, object, 0755) < 0 && errno != EEXIST)
+      result = false;
+   object[2] = '/';
+
+   return result && renameat(fd, tmp, fd, object) == 0;
+}
+
+/**
+ * Whether a stored object shows the same metadata as a file.
+ */
+static bool same_metadata(const struct stat* object, const struct stat* s)
+{
+   return object->st_mode == s->st_mode && object->st_uid == s->st_uid &&
+      object->st_gid == s->st_gid &&
+      object->st_mtim.tv_sec == s->st_mtim.tv_sec &&
+      object->st_mtim.tv_nsec == s->st_mtim.tv_nsec;
+}
+
+/**
+ * Give name a copy of an object of its own that shares the object's
+ * blocks, so it can have its own metadata.
+ *
+ * @return 1 if cloned, 0 if the filesystems cannot clone and -1 on error.
+ */
+static int clone_object(int dest_fd, const char* name, const char* object,
+			const char* source, struct stat* s)
+{
+   struct stat in_stat;
+   struct stat dest_stat;
+   struct fs_pair* pair = NULL;
+   int result = -1;
+   int out = -1;
+   int in = openat(store_fd, object, O_RDONLY);
+
+   if (in == -1)
+      return -1;
+
+   if (fstat(in, &in_stat) == 0 && fstat(dest_fd, &dest_stat) == 0)
+      pair = lookup_fs_pair(in_stat.st_dev, dest_stat.st_dev);
+
+   if (pair && pair->no_reflink)
+   {
+      result = 0;
+      goto done;
+   }
+
+   out = openat(dest_fd, name, O_WRONLY|O_CREAT|O_EXCL, s->st_mode);
+   if (out == -1)
+      goto done;
+
+   if ((result = clone_file(in, out)) > 0)
+      result = copy_time(out, source, s) ? 1 : -1;
+   else if (result == 0)
+      set_no_reflink(pair);
+
+ done:
+   if (out != -1)
+   {
+      close(out);
+      if (result <= 0)
+	 unlinkat(dest_fd, name, 0);
+   }
+   close(in);
+   return result;
+}
+
+/**
+ * Point name at an object in the content store. Objects are kept once
+ * per content, and a backup entry shows the metadata of what it points
+ * at, so a hard link is only made when that matches the file. Otherwise
+ * the object is cloned where the filesystem allows it and the clone gets
+ * the file's metadata, or else a symlink is made.
+ */
+static bool link_object(int dest_fd, const char* name, const char* object,
+			const char* source, struct stat* s)
+{
+   bool result = false;
+   struct stat object_stat;
+   char* path = join_path(store_path, object);
+
+   if (!path)
+   {
+      err("out of memory");
+      return false;
+   }
+
+   bool same = fstatat(store_fd, object, &object_stat, 0) == 0 &&
+      same_metadata(&object_stat, s);
+   int cloned = 0;
+
+   if (same && link_mode == LINK_HARD &&
+       linkat(store_fd, object, dest_fd, name, 0) == 0)
+   {
+      result = true;
+      info("link %s ...",path);
+   }
+   else if (!same && reflink != REFLINK_NEVER &&
+	    (cloned = clone_object(dest_fd, name, object, source, s)))
+   {
+      result = cloned > 0;
+      if (result)
+      {
+	 info("clone %s ...",path);
+      }
+   }
+   else if (symlinkat(path, dest_fd, name) == 0)
+   {
+      result = true;
+      info("link %s ...",path);
+   }
+
+   if (!result)
+   {
+      err("could not link %s", path);
+   }
+
+   free(path);
+   return result;
+}
+
+/**
+ * Add a file to the content store unless an object with the same data
+ * is already there, then link name in the backup to the object. The
+ * file is copied into the store's tmp directory and hashed on the way,
+ * so the source is read once; the copy then becomes the object named
+ * by the hash, or is dropped when the store has that content already.
+ *
+ * @param copied Set to the number of bytes copied.
+ * @param digest Set to the hash of the data.
+ */
+static bool store_file(int source_dir, int dest_dir, const char* name,
+		       const char* source, struct stat* s, off_t* copied,
+		       unsigned char digest[SHA256_SIZE])
+{
+   struct sha256 ctx;
+   char object[128];
+   char tmp[64];
+   int fd;
+
+   *copied = 0;
+
+   if ((fd = store_tmp_file(store_fd, tmp, sizeof(tmp))) == -1)
+   {
+      err("could not store %s", source);
+      return false;
+   }
+   close(fd);
+
+   sha256_init(&ctx);
+   if (!copy_file(source_dir, store_fd, name, tmp, source, s, &ctx))
+   {
+      unlinkat(store_fd, tmp, 0);
+      return false;
+   }
+
+   sha256_final(&ctx, digest);
+   hash_name(digest, object, sizeof(object));
+
+   if (faccessat(store_fd, object, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+      unlinkat(store_fd, tmp, 0);
+   else if (store_rename(store_fd, tmp, object))
+      *copied = s->st_size;
+   else
+   {
+      err("could not store %s", source);
+      unlinkat(store_fd, tmp, 0);
+      return false;
+   }
+
+   return link_object(dest_dir, name, object, source, s);
+}
+
+/**
+ * Write a chunk to the chunk store unless it is already there.
+ *
+ * @param digest Set to the chunk's hash.
+ * @param stored Increased by the bytes written.
+ */
+static bool store_chunk(const unsigned char* data, size_t len,
+			unsigned char digest[SHA256_SIZE], off_t* stored)
+{
+   struct sha256 ctx;
+   char object[128];
+   char tmp[64];
+   size_t done = 0;
+
+   sha256_init(&ctx);
+   sha256_update(&ctx, data, len);
+   sha256_final(&ctx, digest);
+   hash_name(digest, object, sizeof(object));
+
+   if (faccessat(chunk_fd, object, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+      return true;
+
+   int fd = store_tmp_file(chunk_fd, tmp, sizeof(tmp));
+   if (fd == -1)
+      return false;
+
+   while (done < len)
+   {
+      ssize_t written = write(fd, data + done, len - done);
+
+      if (written < 0 && errno == EINTR)
+	 continue;
+
+      if (written <= 0)
+	 break;
+
+      done += written;
+   }
+
+   if (nocache && done == len)
+      drop_cache(-1, fd);
+
+   if (close(fd) < 0 || done < len || !store_rename(chunk_fd, tmp, object))
+   {
+      unlinkat(chunk_fd, tmp, 0);
+      return false;
+   }
+
+   *stored += len;
+   return true;
+}
+
+/**
+ * Split a file into content-defined chunks, store the ones the chunk
+ * store does not have yet, and write a recipe in place of the file. The
+ * recipe holds RECIPE_MAGIC, the file size, the chunk store path and
+ * then the hash and length of each chunk. Unchanged parts of a modified
+ * file are only read, never written.
+ *
+ * @param stored Set to the number of bytes written to the chunk store.
+ */
+static bool chunk_file(int source_dir, int dest_dir, const char* name,
+		       const char* source, struct stat* s, off_t* stored)
+{
+   bool result = false;
+   unsigned char* buffer = NULL;
+   FILE* recipe = NULL;
+   int out = -1;
+   size_t have = 0;
+   bool eof = false;
+   uint64_t size = 0;
+   uint32_t path_len = strlen(chunk_path);
+
+   info("chunk %s ...",source);
+
+   *stored = 0;
+
+   int in = open_source(source_dir, name);
+   if (in == -1 || fstat(in, s) < 0)
+   {
+      err("unable to open `%s'", source);
+      goto done;
+   }
+
+   out = openat(dest_dir, name, O_WRONLY|O_CREAT|O_TRUNC, s->st_mode);
+   if (out == -1 || !(recipe = fdopen(out, "w")))
+   {
+      err("unable to create recipe for `%s'", source);
+      goto done;
+   }
+
+   /* the size is filled in once the file has been read */
+   if (fwrite(RECIPE_MAGIC, 8, 1, recipe) != 1 ||
+       fwrite(&size, sizeof(size), 1, recipe) != 1 ||
+       fwrite(&path_len, sizeof(path_len), 1, recipe) != 1 ||
+       fwrite(chunk_path, path_len, 1, recipe) != 1)
+      goto write_error;
+
+   buffer = (unsigned char*)malloc(CHUNK_BUFFER);
+   if (!buffer)
+   {
+      err("out of memory chunking %s", source);
+      goto done;
+   }
+
+   while (!eof || have)
+   {
+      size_t start = 0;
+      size_t len;
+
+      while (!eof && have < CHUNK_BUFFER)
+      {
+	 ssize_t bytes = read(in, buffer + have, CHUNK_BUFFER - have);
+
+	 if (bytes < 0 && errno == EINTR)
+	    continue;
+
+	 if (bytes < 0)
+	 {
+	    err("unable to read `%s'", source);
+	    goto done;
+	 }
+
+	 eof = bytes == 0;
+	 have += bytes;
+      }
+
+      while (start < have &&
+	     (len = chunk_boundary(buffer + start, have - start, eof)))
+      {
+	 unsigned char digest[SHA256_SIZE];
+	 uint32_t chunk_len = len;
+
+	 if (!store_chunk(buffer + start, len, digest, stored))
+	 {
+	    err("could not store chunk of %s", source);
+	    goto done;
+	 }
+
+	 if (fwrite(digest, sizeof(digest), 1, recipe) != 1 ||
+	     fwrite(&chunk_len, sizeof(chunk_len), 1, recipe) != 1)
+	    goto write_error;
+
+	 start += len;
+	 size += len;
+      }
+
+      memmove(buffer, buffer + start, have - start);
+      have -= start;
+   }
+
+   if (fflush(recipe) != 0 ||
+       pwrite(out, &size, sizeof(size), 8) != sizeof(size))
+      goto write_error;
+
+   result = copy_time(out, source, s);
+
+   if (result && nocache)
+      drop_cache(in, out);
+   goto done;
+
+ write_error:
+   err("unable to write recipe for `%s'", source);
+
+ done:
+   if (recipe)
+   {
+      if (fclose(recipe) != 0)
+	 result = false;
+   }
+   else if (out != -1)
+   {
+      close(out);
+   }
+   if (in != -1)
+      close(in);
+   free(buffer);
+   return result;
+}
+
+/**
+ * Whether a file in a previous backup is a chunk recipe.
+ */
+static bool is_recipe(int dir_fd, const char* name)
+{
+   char magic[8];
+   int fd = openat(dir_fd, name, O_RDONLY);
+   bool result = fd != -1 && pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      !memcmp(magic, RECIPE_MAGIC, sizeof(magic));
+
+   if (fd != -1)
+      close(fd);
+   return result;
+}
+
+/**
+ * Whether the stored copy of a file is a recipe this run cannot point
+ * at. Outside of --chunks a backup holds the data of its files.
+ */
+static inline bool foreign_recipe(const struct manifest_entry* e)
+{
+   return (e->flags & MANIFEST_IS_RECIPE) && !use_chunks;
+}
+
+/**
+ * Write the data a recipe describes to stdout.
+ */
+static bool extract_recipe(const char* file)
+{
+   bool result = false;
+   char magic[8];
+   uint64_t size;
+   uint64_t total = 0;
+   uint32_t path_len;
+   char* path = NULL;
+   int fd = -1;
+   unsigned char* buffer = (unsigned char*)malloc(CHUNK_MAX);
+   FILE* recipe = fopen(file, "r");
+
+   if (!recipe || !buffer ||
+       fread(magic, sizeof(magic), 1, recipe) != 1 ||
+       memcmp(magic, RECIPE_MAGIC, sizeof(magic)) ||
+       fread(&size, sizeof(size), 1, recipe) != 1 ||
+       fread(&path_len, sizeof(path_len), 1, recipe) != 1 ||
+       path_len > PATH_MAX || !(path = (char*)calloc(1, path_len + 1)) ||
+       fread(path, path_len, 1, recipe) != 1 ||
+       (fd = open(path, O_RDONLY|O_DIRECTORY)) == -1)
+   {
+      err("could not read recipe %s", file);
+      goto done;
+   }
+
+   for (;;)
+   {
+      unsigned char digest[SHA256_SIZE];
+      char object[128];
+      uint32_t len;
+
+      if (fread(digest, sizeof(digest), 1, recipe) != 1)
+	 break;
+
+      if (fread(&len, sizeof(len), 1, recipe) != 1 || len > CHUNK_MAX)
+      {
+	 err("could not read recipe %s", file);
+	 goto done;
+      }
+
+      hash_name(digest, object, sizeof(object));
+
+      int in = openat(fd, object, O_RDONLY);
+      ssize_t bytes = in == -1 ? -1 : pread(in, buffer, len, 0);
+
+      if (in != -1)
+	 close(in);
+
+      if (bytes != (ssize_t)len || fwrite(buffer, len, 1, stdout) != 1)
+      {
+	 err("could not read chunk %s/%s", path, object);
+	 goto done;
+      }
+
+      total += len;
+   }
+
+   result = total == size && fflush(stdout) == 0;
+
+ done:
+   if (fd != -1)
+      close(fd);
+   if (recipe)
+      fclose(recipe);
+   free(path);
+   free(buffer);
+   return result;
+}
+
+/**
+ * Copy from the current offset of in to the end, in the kernel when the
+ * filesystems allow it and the data is not to be hashed.
+ *
+ * @param hash If not NULL, the data copied is added to it.
+ */
+static bool copy_rest(int in, int out, const char* source, struct stat* s,
+		      struct sha256* hash)
+{
+   off_t copied = 0;
+   int ret = hash ? 0 : copy_kernel(in, out, reflink == REFLINK_NEVER ?
+				    COPY_SENDFILE : COPY_RANGE, &copied);
+
+   if (ret == 0)
+      return copy_readwrite(in, out, source, s, hash);
+
+   if (ret < 0)
+      err("incomplete copy of file %s", source);
+   return ret > 0;
+}
+
+/**
+ * Where delta_file() writes a new version.
+ */
+struct delta_output
+{
+   int old_fd;
+   int out;
+   const char* source;
+   /* bytes written so far, and the literal ones among them */
+   off_t offset;
+   off_t literal;
+   /* filesystem block size, the alignment clones need */
+   off_t align;
+   /* a run of the old version landed where it cannot be cloned */
+   bool misaligned;
+};
+
+/**
+ * Append a run of the new version to the output, either literal data or
+ * a range of the old version, which the kernel can share without it
+ * passing through here. Ranges can only be shared at the same offset
+ * within a block in both files, so once literal data shifts the output
+ * off block boundaries the scan is stopped.
+ */
+static bool delta_write(void* arg, const unsigned char* data, off_t old_offset,
+			size_t len)
+{
+   struct delta_output* output = (struct delta_output*)arg;
+
+   if (data)
+   {
+      output->literal += len;
+      output->offset += len;
+      if (write_all(output->out, data, len))
+	 return true;
+
+      err("incomplete copy of file %s", output->source);
+      return false;
+   }
+
+   if (old_offset % output->align || output->offset % output->align)
+   {
+      output->misaligned = true;
+      return false;
+   }
+
+   output->offset += len;
+   if (copy_range(output->old_fd, old_offset, len, output->out))
+      return true;
+
+   err("unable to copy previous version of `%s'", output->source);
+   return false;
+}
+
+/**
+ * Build a changed file from the blocks of its previous version that are
+ * still in it plus the data that is new, rsync style. Only done when the
+ * destination can share ranges of the previous copy, otherwise the
+ * matching blocks would be read and written again on top of reading
+ * both versions. That sharing needs the blocks to stay on block
+ * boundaries, so this pays off for files edited in place; after an
+ * insert or delete of other than whole blocks the rest is copied.
+ *
+ * @param old_fd The previous version, open for reading.
+ * @param copied Set to the bytes that were not in the previous version.
+ * @param hash If not NULL, the new version is added to it.
+ * @return 1 when done, 0 if ranges of the previous copy cannot be shared
+ * and -1 on error.
+ */
+static int delta_file(int old_fd, int source_dir, int dest_dir,
+		      const char* name, const char* source, struct stat* s,
+		      off_t* copied, struct sha256* hash)
+{
+   int result = -1;
+   struct delta_index* index = NULL;
+   struct delta_output output = { old_fd, -1, source, 0, 0, 0, false };
+
+   int in = open_source(source_dir, name);
+   if (in == -1 || fstat(in, s) < 0)
+   {
+      err("unable to open `%s'", source);
+      goto done;
+   }
+
+   output.out = openat(dest_dir, name, O_WRONLY|O_CREAT|O_TRUNC, s->st_mode);
+   if (output.out == -1)
+   {
+      err("unable to create copy of `%s'", source);
+      goto done;
+   }
+
+   if ((result = clone_range_works(old_fd, output.out)) <= 0)
+   {
+      if (result < 0)
+	 err("unable to create copy of `%s'", source);
+      goto done;
+   }
+
+   info("delta %s ...",source);
+
+   struct stat out_stat;
+   output.align = fstat(output.out, &out_stat) == 0 && out_stat.st_blksize > 0 ?
+      out_stat.st_blksize : 4096;
+
+   if (!(index = delta_index_new(old_fd, delta_block_size(s->st_size))))
+   {
+      err("unable to read previous version of `%s'", source);
+      result = -1;
+      goto done;
+   }
+
+   bool ok = delta_scan(index, in, delta_write, &output, hash);
+
+   /* what the scan has read is hashed already, the rest is on the way */
+   if (!ok && output.misaligned)
+   {
+      off_t scanned = lseek(in, 0, SEEK_CUR);
+
+      info("copy rest of %s ...",source);
+      output.literal += s->st_size - output.offset;
+      ok = scanned >= output.offset &&
+	 copy_range(in, output.offset, scanned - output.offset, output.out) &&
+	 copy_rest(in, output.out, source, s, hash);
+      if (!ok)
+	 err("incomplete copy of file %s", source);
+   }
+
+   result = ok && copy_time(output.out, source, s) ? 1 : -1;
+
+   if (result > 0 && nocache)
+   {
+      drop_cache(in, output.out);
+      drop_cache(old_fd, -1);
+   }
+
+ done:
+   if (result)
+      *copied = output.literal;
+   delta_index_free(index);
+   if (output.out != -1)
+      close(output.out);
+   if (in != -1)
+      close(in);
+   return result;
+}
+
+/**
+ * Finish a hash into the digest kept in the manifest, leaving ctx as
+ * it was so more data can be added.
+ */
+static void finish_digest(const struct sha256* ctx,
+			  unsigned char digest[MANIFEST_DIGEST_SIZE])
+{
+   struct sha256 copy = *ctx;
+   unsigned char full[SHA256_SIZE];
+
+   sha256_final(&copy, full);
+   memcpy(digest, full, MANIFEST_DIGEST_SIZE);
+}
+
+/**
+ * Build a file that only grew since the previous backup from the
+ * previous copy, cloned when possible, and the bytes appended since.
+ * It counts as grown when all of the old data in the source still
+ * hashes to the digest kept in the manifest, so the source is read in
+ * full but only the appended bytes are written.
+ *
+ * @param old_fd The previous copy, open for reading.
+ * @param prev The previous manifest entry of the file.
+ * @param copied Set to the bytes appended.
+ * @param digest Set to the digest of the new copy.
+ * @return 1 when done, 0 if the file is not an append and -1 on error.
+ */
+static int append_file(int old_fd, const struct manifest_entry* prev,
+		       int source_dir, int dest_dir, const char* name,
+		       const char* source, struct stat* s, off_t* copied,
+		       unsigned char digest[MANIFEST_DIGEST_SIZE])
+{
+   int result = 0;
+   int out = -1;
+   struct stat old_stat;
+   struct sha256 ctx;
+   off_t old_size = prev->size;
+
+   if (!use_append || !(prev->flags & MANIFEST_HAS_DIGEST) ||
+       s->st_size <= old_size)
+      return 0;
+
+   /* a chunk recipe or a copy changed since is no base to append to */
+   if (fstat(old_fd, &old_stat) < 0 || !S_ISREG(old_stat.st_mode) ||
+       old_stat.st_size != old_size)
+      return 0;
+
+   int in = open_source(source_dir, name);
+   if (in == -1 || fstat(in, s) < 0)
+   {
+      err("unable to open `%s'", source);
+      result = -1;
+      goto done;
+   }
+
+   if (s->st_size <= old_size)
+      goto done;
+
+   sha256_init(&ctx);
+   if (!hash_range(in, source, 0, old_size, &ctx))
+      goto done;
+
+   finish_digest(&ctx, digest);
+   if (memcmp(digest, prev->digest, MANIFEST_DIGEST_SIZE))
+      goto done;
+
+   info("append %s ...",source);
+
+   out = openat(dest_dir, name, O_WRONLY|O_CREAT|O_TRUNC, s->st_mode);
+   if (out == -1)
+   {
+      err("unable to create copy of `%s'", source);
+      result = -1;
+      goto done;
+   }
+
+   result = -1;
+
+   if (reflink == REFLINK_NEVER || clone_file(old_fd, out) <= 0)
+   {
+      if (reflink == REFLINK_ALWAYS)
+      {
+	 err("unable to clone `%s'", source);
+	 goto done;
+      }
+
+      if (ftruncate(out, 0) < 0 || lseek(old_fd, 0, SEEK_SET) < 0 ||
+	  !copy_rest(old_fd, out, source, s, NULL))
+	 goto done;
+   }
+
+   /* the appended bytes complete the hash on their way through */
+   if (lseek(in, old_size, SEEK_SET) < 0 || lseek(out, old_size, SEEK_SET) < 0 ||
+       !copy_rest(in, out, source, s, &ctx) || !copy_time(out, source, s))
+      goto done;
+
+   finish_digest(&ctx, digest);
+
+   *copied = s->st_size - old_size;
+   result = 1;
+
+   if (nocache)
+   {
+      drop_cache(in, out);
+      drop_cache(old_fd, -1);
+   }
+
+ done:
+   if (out != -1)
+      close(out);
+   if (in != -1)
+      close(in);
+   return result;
+}
+
+/**
+ * pread() len bytes, less only at the end of the file.
+ *
+ * @return the bytes read or -1 on error.
+ */
+static ssize_t pread_full(int fd, char* buffer, size_t len, off_t offset)
+{
+   size_t done = 0;
+
+   while (done < len)
+   {
+      ssize_t bytes = pread(fd, buffer + done, len - done, offset + done);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      if (bytes < 0)
+	 return -1;
+
+      if (bytes == 0)
+	 break;
+
+      done += bytes;
+   }
+
+   return done;
+}
+
+/**
+ * Update a file rewritten in place, like a database or disk image, by
+ * cloning its previous copy and then writing only the BLOCKS_SIZE
+ * blocks that differ from it. Writes and new space on the destination
+ * follow the changed blocks rather than the size of the file.
+ *
+ * @param old_fd The previous copy, open for reading.
+ * @param copied Set to the bytes written.
+ * @param hash If not NULL, the new version is added to it.
+ * @return 1 when done, 0 if the previous copy cannot be cloned and -1
+ * on error.
+ */
+static int blocks_file(int old_fd, int source_dir, int dest_dir,
+		       const char* name, const char* source, struct stat* s,
+		       off_t* copied, struct sha256* hash)
+{
+   int result = 0;
+   int out = -1;
+   struct stat old_stat;
+   struct stat out_stat;
+   struct fs_pair* pair = NULL;
+   char* buffer = get_copy_buffer(2 * BLOCKS_SIZE);
+   char* old = buffer + BLOCKS_SIZE;
+   off_t offset;
+
+   if (reflink == REFLINK_NEVER || !buffer ||
+       fstat(old_fd, &old_stat) < 0 || !S_ISREG(old_stat.st_mode))
+      return 0;
+
+   int in = open_source(source_dir, name);
+   if (in == -1 || fstat(in, s) < 0)
+   {
+      err("unable to open `%s'", source);
+      result = -1;
+      goto done;
+   }
+
+   out = openat(dest_dir, name, O_WRONLY|O_CREAT|O_TRUNC, s->st_mode);
+   if (out == -1)
+   {
+      err("unable to create copy of `%s'", source);
+      result = -1;
+      goto done;
+   }
+
+   if (fstat(out, &out_stat) == 0)
+      pair = lookup_fs_pair(old_stat.st_dev, out_stat.st_dev);
+
+   /* without a clone every block would be written anyway */
+   if ((pair && pair->no_reflink) || (result = clone_file(old_fd, out)) <= 0)
+   {
+      if (result < 0)
+      {
+	 err("unable to clone previous version of `%s'", source);
+      }
+      else
+	 set_no_reflink(pair);
+      goto done;
+   }
+
+   info("blocks %s ...",source);
+
+   result = -1;
+   *copied = 0;
+
+   for (offset = 0; offset < s->st_size; offset += BLOCKS_SIZE)
+   {
+      ssize_t len = pread_full(in, buffer, BLOCKS_SIZE, offset);
+      ssize_t old_len = len > 0 ? pread_full(old_fd, old, len, offset) : 0;
+
+      if (len < 0 || old_len < 0)
+      {
+	 err("unable to read `%s'", source);
+	 goto done;
+      }
+
+      /* the file shrank while being read */
+      if (len == 0)
+	 break;
+
+      if (hash)
+	 sha256_update(hash, buffer, len);
+
+      if (old_len == len && !memcmp(buffer, old, len))
+	 continue;
+
+      if (pwrite(out, buffer, len, offset) != len)
+      {
+	 err("incomplete copy of file %s", source);
+	 goto done;
+      }
+
+      *copied += len;
+   }
+
+   if (ftruncate(out, offset < s->st_size ? offset : s->st_size) < 0 ||
+       !copy_time(out, source, s))
+   {
+      err("incomplete copy of file %s", source);
+      goto done;
+   }
+
+   result = 1;
+
+   if (nocache)
+   {
+      drop_cache(in, out);
+      drop_cache(old_fd, -1);
+   }
+
+ done:
+   if (out != -1)
+      close(out);
+   if (in != -1)
+      close(in);
+   return result;
+}
+
+/**
+ * Remove what runs that were killed left in a store's tmp directory.
+ */
+static void clean_store_tmp(int fd)
+{
+   int tmp_fd = openat(fd, "tmp", O_RDONLY|O_DIRECTORY);
+   DIR* d = tmp_fd != -1 ? fdopendir(tmp_fd) : NULL;
+   struct dirent* entry;
+
+   if (!d)
+   {
+      if (tmp_fd != -1)
+	 close(tmp_fd);
+      return;
+   }
+
+   while ((entry = readdir(d)))
+      if (!ignore_dir(entry->d_name))
+	 unlinkat(tmp_fd, entry->d_name, 0);
+
+   closedir(d);
+}
+
+/**
+ * Create and open a store directory with its tmp directory. The store
+ * stays share locked while it is open, and its tmp directory is only
+ * cleaned out when no other run has it open.
+ *
+ * @param path Set to the path of the store.
+ * @return a descriptor for the store, or -1.
+ */
+static int open_store(const char* root, const char* name, char** path)
+{
+   int fd;
+
+   *path = join_path(root, name);
+
+   if (!*path || rmkdir(*path, 0755) < 0 ||
+       (fd = open(*path, O_RDONLY|O_DIRECTORY)) == -1)
+      return -1;
+
+   if (mkdirat(fd, "tmp", 0700) < 0 && errno != EEXIST)
+   {
+      close(fd);
+      return -1;
+   }
+
+   if (flock(fd, LOCK_EX|LOCK_NB) == 0)
+      clean_store_tmp(fd);
+   flock(fd, LOCK_SH);
+
+   return fd;
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix.
+ *
+ * @return the size, or 0 if it is not valid.
+ */
+static size_t parse_size(const char* str)
+{
+   char* end;
+   unsigned long long size = strtoull(str, &end, 10);
+
+   switch (*end)
+   {
+   case 'g': case 'G':
+      size *= 1024;
+      /* fall through */
+   case 'm': case 'M':
+      size *= 1024;
+      /* fall through */
+   case 'k': case 'K':
+      size *= 1024;
+      end++;
+   }
+
+   if (*end || end == str)
+      return 0;
+
+   return size;
+}
+
+static const char* current_time(const char* format)
+{
+   static char date[1024];
+   time_t now;
+   struct tm tnow;
+   time(&now);
+   tnow = *localtime(&now);
+   strftime(date,32,format,&tnow);
+   return date;
+}
+
+/**
+ * A destination directory whose time, permissions and ownership can only
+ * be set once everything below it has been written.
+ */
+struct dir_node
+{
+   /* source path, for messages and --exclude */
+   char* path;
+   /* path of this directory in the previous backup, if it has one */
+   char* prev_path;
+   int src_fd;
+   int dest_fd;
+   int prev_fd;
+   /* statx() flags for the source and previous backup filesystems */
+   int src_flags;
+   int prev_flags;
+   /* the previous backup's filesystem drops the nanoseconds of times */
+   bool prev_seconds;
+   struct stat stat;
+   /* false for the directories holding the SOURCE arguments */
+   bool apply_stat;
+   /* entries were merged against the previous manifest */
+   bool joined;
+   int pending;
+   struct dir_node* parent;
+};
+
+/**
+ * A regular file waiting to be copied or mirrored.
+ */
+struct file_task
+{
+   char* name;
+   struct stat stat;
+   struct dir_node* dir;
+   /* the file in the previous manifest, when dir is joined */
+   struct manifest_entry prev;
+   bool has_prev;
+   /* set for a worker helping with a split copy instead of a file */
+   struct split_copy* split;
+};
+
+/**
+ * Bounded queue of file tasks feeding the copy workers.
+ */
+struct task_queue
+{
+   struct file_task** tasks;
+   size_t size;
+   size_t head;
+   size_t count;
+   bool done;
+   pthread_mutex_t lock;
+   pthread_cond_t not_empty;
+   pthread_cond_t not_full;
+};
+
+static struct task_queue queue =
+{
+   NULL, 0, 0, 0, false,
+   PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+static inline void set_failed(void)
+{
+   __atomic_store_n(&failed, true, __ATOMIC_RELAXED);
+}
+
+static inline bool has_failed(void)
+{
+   return __atomic_load_n(&failed, __ATOMIC_RELAXED);
+}
+
+static struct dir_node* alloc_dir_node(const char* path, struct dir_node* parent)
+{
+   struct dir_node* dir = (struct dir_node*)malloc(sizeof(*dir));
+
+   if (!dir)
+      return NULL;
+
+   dir->path = strdup(path);
+   dir->prev_path = NULL;
+   dir->src_fd = dir->dest_fd = dir->prev_fd = -1;
+   dir->src_flags = parent ? parent->src_flags : 0;
+   dir->prev_flags = parent ? parent->prev_flags : 0;
+   dir->prev_seconds = parent && parent->prev_seconds;
+   dir->apply_stat = true;
+   dir->joined = false;
+   dir->pending = 1;
+   dir->parent = parent;
+
+   if (!dir->path)
+   {
+      free(dir);
+      return NULL;
+   }
+
+   return dir;
+}
+
+static void free_dir_node(struct dir_node* dir)
+{
+   if (dir->src_fd != -1)
+      close(dir->src_fd);
+   if (dir->dest_fd != -1)
+      close(dir->dest_fd);
+   if (dir->prev_fd != -1)
+      close(dir->prev_fd);
+   free(dir->path);
+   free(dir->prev_path);
+   free(dir);
+}
+
+static inline void dir_ref(struct dir_node* dir)
+{
+   if (dir)
+      __atomic_add_fetch(&dir->pending, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a reference on a directory. The last one out applies the
+ * directory's stat information and releases its parent.
+ */
+static void dir_release(struct dir_node* dir)
+{
+   while (dir && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0)
+   {
+      struct dir_node* parent = dir->parent;
+
+      if (dir->apply_stat && !has_failed() &&
+	  !copy_time(dir->dest_fd,dir->path,&dir->stat))
+	 set_failed();
+
+      free_dir_node(dir);
+      dir = parent;
+   }
+}
+
+static void free_task(struct file_task* task)
+{
+   free(task->name);
+   free(task);
+}
+
+/**
+ * Same test as file_changed(), against a manifest entry. The manifest
+ * keeps the source times as they were, so they always compare to the
+ * nanosecond.
+ */
+static inline bool entry_changed(const struct stat* s,
+				 const struct manifest_entry* prev)
+{
+   if ((uint64_t)s->st_size != prev->size)
+      return true;
+
+   return stat_mtime_ns(s) != prev->mtime_ns;
+}
+
+/**
+ * Find which backup a freshly made symlink points into, when the previous
+ * backup has no manifest to say so.
+ */
+static uint32_t symlink_root(int dest_fd, const char* name, const char* key)
+{
+   char buffer[PATH_MAX+1];
+   ssize_t len = readlinkat(dest_fd, name, buffer, PATH_MAX);
+   size_t key_len = strlen(key);
+
+   if (len <= (ssize_t)key_len || buffer[len-key_len-1] != '/' ||
+       memcmp(buffer+len-key_len, key, key_len))
+      return MANIFEST_NO_ROOT;
+
+   buffer[len-key_len-1] = 0;
+   return manifest_writer_root(new_manifest, buffer);
+}
+
+/**
+ * Mirror a file the previous manifest says is unchanged.
+ */
+static bool mirror_entry(struct dir_node* dir, const char* name,
+			 const char* key, const char* prev_root)
+{
+   char* target = join_path(prev_root, key);
+   bool result;
+
+   if (!target)
+   {
+      err("out of memory");
+      return false;
+   }
+
+   info("mirror %s ...",target);
+
+   result = symlinkat(target, dir->dest_fd, name) == 0;
+   free(target);
+   return result;
+}
+
+/**
+ * Hard link an unchanged file to its stored copy, following the symlinks
+ * left by earlier backups.
+ *
+ * @return 0, or the errno from linkat().
+ */
+static int link_file(int prev_fd, const char* prev, int dest_fd,
+		     const char* name, const char* source)
+{
+   if (linkat(prev_fd, prev, dest_fd, name, AT_SYMLINK_FOLLOW) < 0)
+      return errno;
+
+   info("link %s ...",source);
+   return 0;
+}
+
+/**
+ * Copy or mirror a regular file.
+ */
+static bool process_regular(struct file_task* task)
+{
+   bool result;
+   struct dir_node* dir = task->dir;
+   char buffer[PATH_MAX+1];
+   const char* source = entry_path(buffer, sizeof(buffer), dir->path, task->name);
+   /* where the file sits below a backup directory */
+   const char* key = source;
+   struct manifest_entry entry;
+   const char* prev_root;
+   /*
+    * Why no hard link was made, EXDEV meaning use a symlink. A hard link
+    * shares its metadata with every backup holding it, so one is only
+    * made when the mode is unchanged, otherwise the file is copied.
+    */
+   int error = link_mode == LINK_HARD ? EPERM : EXDEV;
+   /* previous version of a changed file, for --delta, --append, --blocks */
+   int old_fd = -1;
+
+   memset(&entry, 0, sizeof(entry));
+
+   while (*key == '/')
+      key++;
+
+   if (prev_manifest)
+   {
+      /*
+       * Everything needed is in the previous manifest, so the previous
+       * backup tree is not touched at all.
+       */
+      bool found = dir->joined ? task->has_prev :
+	 manifest_lookup(prev_manifest, key, &task->prev);
+
+      entry = task->prev;
+
+      if (!force_copy && found && S_ISREG(entry.mode) &&
+	  !entry_changed(&task->stat, &entry) && !foreign_recipe(&entry) &&
+	  (prev_root = manifest_root(prev_manifest, entry.root)))
+      {
+	 if (link_mode == LINK_HARD && entry.mode == task->stat.st_mode)
+	 {
+	    char* target = join_path(prev_root, key);
+
+	    error = target ? link_file(AT_FDCWD, target, dir->dest_fd,
+				       task->name, source) : ENOMEM;
+	    free(target);
+	 }
+
+	 /* across filesystems, fall back to a symlink */
+	 if (error == EXDEV)
+	 {
+	    result = mirror_entry(dir, task->name, key, prev_root);
+	    goto done;
+	 }
+      }
+
+      if (!force_copy && found && S_ISREG(entry.mode) &&
+	  !(entry.flags & MANIFEST_IS_RECIPE) &&
+	  ((use_delta && task->stat.st_size >= DELTA_MIN_FILE) ||
+	   (use_blocks && task->stat.st_size >= BLOCKS_MIN_FILE) ||
+	   (use_append && (entry.flags & MANIFEST_HAS_DIGEST) &&
+	    task->stat.st_size > (off_t)entry.size)) &&
+	  (prev_root = manifest_root(prev_manifest, entry.root)))
+      {
+	 char* old = join_path(prev_root, key);
+
+	 if (old)
+	    old_fd = open(old, O_RDONLY);
+	 free(old);
+      }
+   }
+   else
+   {
+      /*
+       * If the current file has a different size or modification time than
+       * the previous file, do a fresh copy, otherwise symlink to previous
+       * backup.
+       */
+      struct stat prev_stat;
+      bool found = dir->prev_fd != -1 && !force_copy &&
+	 stat_at(dir->prev_fd, task->name, dir->prev_flags, MASK_CHANGED, &prev_stat) == 0;
+      bool unchanged = found &&
+	 !file_changed(&task->stat, &prev_stat, dir->prev_seconds);
+
+      /*
+       * A recipe is smaller than the file it stands for, so this is only
+       * a safety net for a file cut down to the size of its recipe.
+       */
+      if (unchanged && (use_chunks || old_recipes) &&
+	  is_recipe(dir->prev_fd, task->name))
+      {
+	 entry.flags |= MANIFEST_IS_RECIPE;
+	 unchanged = use_chunks;
+      }
+
+      if (unchanged)
+      {
+	 if (link_mode == LINK_HARD && prev_stat.st_mode == task->stat.st_mode)
+	    error = link_file(dir->prev_fd, task->name, dir->dest_fd,
+			      task->name, source);
+
+	 if (error == EXDEV)
+	 {
+	    result = symlink_file(dir->prev_fd,dir->prev_path,dir->prev_flags,
+				  dir->dest_fd,task->name);
+	    if (result && new_manifest)
+	       entry.root = symlink_root(dir->dest_fd, task->name, key);
+	    goto done;
+	 }
+      }
+
+      if (found && S_ISREG(prev_stat.st_mode) &&
+	  ((use_delta && task->stat.st_size >= DELTA_MIN_FILE) ||
+	   (use_blocks && task->stat.st_size >= BLOCKS_MIN_FILE)))
+	 old_fd = openat(dir->prev_fd, task->name, O_RDONLY);
+   }
+
+   /* the linked file is as good a stored copy as the one it links to */
+   if (!error)
+   {
+      result = true;
+      entry.root = dest_root;
+      goto done;
+   }
+
+   off_t copied = task->stat.st_size;
+   unsigned char digest[SHA256_SIZE];
+   int appended = 0;
+   int patched = 0;
+   /*
+    * Remember what is copied so the next backup can append to it, with
+    * the hash taken while the data goes by.
+    */
+   struct sha256 ctx;
+   struct sha256* hash = NULL;
+
+   if (use_append && new_manifest && task->stat.st_size >= APPEND_MIN_FILE)
+   {
+      sha256_init(&ctx);
+      hash = &ctx;
+   }
+
+   if (use_chunks && task->stat.st_size >= CHUNK_MIN_FILE)
+      result = chunk_file(dir->src_fd, dir->dest_fd, task->name, source,
+			  &task->stat, &copied);
+   else if (use_store)
+      result = store_file(dir->src_fd, dir->dest_fd, task->name, source,
+			  &task->stat, &copied, digest);
+   else if (old_fd != -1 &&
+	    (appended = append_file(old_fd, &entry, dir->src_fd, dir->dest_fd,
+				    task->name, source, &task->stat, &copied,
+				    digest)))
+      result = appended > 0;
+   else if (old_fd != -1 && use_blocks &&
+	    task->stat.st_size >= BLOCKS_MIN_FILE &&
+	    (patched = blocks_file(old_fd, dir->src_fd, dir->dest_fd,
+				   task->name, source, &task->stat, &copied,
+				   hash)))
+      result = patched > 0;
+   else if (old_fd != -1 && use_delta &&
+	    task->stat.st_size >= DELTA_MIN_FILE &&
+	    (patched = delta_file(old_fd, dir->src_fd, dir->dest_fd,
+				  task->name, source, &task->stat, &copied,
+				  hash)))
+      result = patched > 0;
+   else
+      result = copy_file(dir->src_fd,dir->dest_fd,task->name,task->name,source,
+			 &task->stat, hash);
+   entry.root = dest_root;
+   entry.flags &= ~(MANIFEST_HAS_DIGEST | MANIFEST_IS_RECIPE);
+
+   if (result && use_chunks && task->stat.st_size >= CHUNK_MIN_FILE)
+      entry.flags |= MANIFEST_IS_RECIPE;
+
+   if (appended > 0 || (result && hash && use_store &&
+			!(use_chunks && task->stat.st_size >= CHUNK_MIN_FILE)))
+   {
+      memcpy(entry.digest, digest, sizeof(entry.digest));
+      entry.flags |= MANIFEST_HAS_DIGEST;
+   }
+   else if (result && hash && !use_store &&
+	    !(use_chunks && task->stat.st_size >= CHUNK_MIN_FILE))
+   {
+      finish_digest(hash, entry.digest);
+      entry.flags |= MANIFEST_HAS_DIGEST;
+   }
+
+   if (count_bytes)
+   {
+      __atomic_add_fetch(&bytes_copied, copied, __ATOMIC_RELAXED);
+   }
+
+ done:
+   if (old_fd != -1)
+      close(old_fd);
+
+   if (result && new_manifest)
+   {
+      entry.size = task->stat.st_size;
+      entry.mtime_ns = stat_mtime_ns(&task->stat);
+      entry.ino = task->stat.st_ino;
+      entry.mode = task->stat.st_mode;
+
+      if (!manifest_add(new_manifest, key, &entry))
+      {
+	 err("out of memory");
+	 result = false;
+      }
+   }
+
+   return result;
+}
+
+static void run_task(struct file_task* task)
+{
+   struct dir_node* dir = task->dir;
+
+   if (task->split)
+   {
+      split_run(task->split);
+      split_release(task->split);
+   }
+   else if (!has_failed() && !process_regular(task))
+      set_failed();
+
+   free_task(task);
+   dir_release(dir);
+}
+
+/**
+ * Hand a file task to the copy workers, or run it right away when
+ * there are none. Blocks while the queue is full.
+ */
+static void submit_task(struct file_task* task)
+{
+   if (!queue.size)
+   {
+      run_task(task);
+      return;
+   }
+
+   pthread_mutex_lock(&queue.lock);
+   while (queue.count == queue.size)
+      pthread_cond_wait(&queue.not_full, &queue.lock);
+
+   queue.tasks[(queue.head + queue.count++) % queue.size] = task;
+
+   pthread_cond_signal(&queue.not_empty);
+   pthread_mutex_unlock(&queue.lock);
+}
+
+/**
+ * Ask a copy worker to help with a split copy. The task goes to the front
+ * of the queue, and is not queued at all when the queue is full, as the
+ * copy can do without it and the caller may be the one emptying it.
+ *
+ * @return false if it was not queued.
+ */
+static bool submit_split(struct split_copy* copy)
+{
+   struct file_task* task = (struct file_task*)calloc(1, sizeof(*task));
+   bool queued = false;
+
+   if (!task)
+      return false;
+
+   task->split = copy;
+
+   pthread_mutex_lock(&queue.lock);
+   if (queue.size && queue.count < queue.size)
+   {
+      __atomic_add_fetch(&copy->refs, 1, __ATOMIC_RELAXED);
+      queue.head = (queue.head + queue.size - 1) % queue.size;
+      queue.tasks[queue.head] = task;
+      queue.count++;
+      queued = true;
+      pthread_cond_signal(&queue.not_empty);
+   }
+   pthread_mutex_unlock(&queue.lock);
+
+   if (!queued)
+      free(task);
+   return queued;
+}
+
+static void* copy_worker(void* arg)
+{
+   for (;;)
+   {
+      struct file_task* task;
+
+      pthread_mutex_lock(&queue.lock);
+      while (!queue.count && !queue.done)
+	 pthread_cond_wait(&queue.not_empty, &queue.lock);
+
+      if (!queue.count)
+      {
+	 pthread_mutex_unlock(&queue.lock);
+	 break;
+      }
+
+      task = queue.tasks[queue.head];
+      queue.head = (queue.head + 1) % queue.size;
+      queue.count--;
+
+      pthread_cond_signal(&queue.not_full);
+      pthread_mutex_unlock(&queue.lock);
+
+      run_task(task);
+   }
+
+   thread_cleanup();
+   return NULL;
+}
+
+/**
+ * Start the copy workers.
+ */
+static pthread_t* start_workers(int count)
+{
+   pthread_t* threads = (pthread_t*)calloc(count, sizeof(pthread_t));
+   int x;
+
+   queue.size = count * 64;
+   queue.tasks = (struct file_task**)calloc(queue.size, sizeof(struct file_task*));
+
+   if (!threads || !queue.tasks)
+   {
+      err("out of memory");
+      exit(1);
+   }
+
+   for (x = 0; x < count; x++)
+   {
+      if (pthread_create(&threads[x], NULL, copy_worker, NULL))
+      {
+	 err("could not start copy worker");
+	 exit(1);
+      }
+   }
+
+   return threads;
+}
+
+/**
+ * Wait for the copy workers to drain the queue and exit.
+ */
+static void stop_workers(pthread_t* threads, int count)
+{
+   int x;
+
+   pthread_mutex_lock(&queue.lock);
+   queue.done = true;
+   pthread_cond_broadcast(&queue.not_empty);
+   pthread_mutex_unlock(&queue.lock);
+
+   for (x = 0; x < count; x++)
+      pthread_join(threads[x], NULL);
+
+   free(threads);
+   free(queue.tasks);
+}
+
+/**
+ * A directory waiting to be scanned.
+ */
+struct dir_item
+{
+   char* name;
+   struct stat stat;
+   bool has_stat;
+   /* the directory in the previous manifest, when parent is joined */
+   struct manifest_entry prev;
+   bool has_prev;
+   struct dir_node* parent;
+};
+
+/**
+ * Per traversal thread deque of directories. The owner pushes and pops
+ * at the bottom, idle threads steal from the top.
+ */
+struct scan_deque
+{
+   struct dir_item** items;
+   size_t size;
+   size_t top;
+   size_t bottom;
+   pthread_mutex_t lock;
+};
+
+static struct scan_deque* deques = NULL;
+static __thread struct scan_deque* own_deque = NULL;
+
+/* directories pushed but not yet scanned, plus one held by main() */
+static int scan_pending = 0;
+/* directories sitting in a deque */
+static int scan_queued = 0;
+static int scan_idle = 0;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_wake = PTHREAD_COND_INITIALIZER;
+
+bool process_file(struct dir_node* parent, const char* name,
+		  unsigned char type, const struct stat* known_stat,
+		  const struct manifest_entry* prev);
+
+#ifdef HAVE_IO_URING
+/**
+ * Process the entries of an open directory, fetching the stat information
+ * of up to URING_DEPTH entries at a time with one io_uring submission.
+ * Stops early, leaving the rest of the directory unread, if the ring had
+ * to be dropped.
+ */
+static bool scan_entries_uring(struct uring* ring, DIR* d, struct dir_node* dir)
+{
+   char* names[URING_DEPTH];
+   unsigned char types[URING_DEPTH];
+   int res[URING_DEPTH];
+   bool result = true;
+   bool more = true;
+   size_t count;
+   size_t x;
+
+   /* on the heap, so it can be left to requests that were never reaped */
+   struct statx* stx = (struct statx*)malloc(URING_DEPTH * sizeof(*stx));
+
+   if (!stx)
+   {
+      err("out of memory");
+      return false;
+   }
+
+   while (more && result && !has_failed())
+   {
+      struct dirent* entry = NULL;
+      size_t submitted = 0;
+
+      for (count = 0; count < URING_DEPTH && (entry = readdir(d)); )
+      {
+	 if (ignore_dir(entry->d_name))
+	    continue;
+
+	 if (!(names[count] = strdup(entry->d_name)))
+	 {
+	    err("out of memory");
+	    result = false;
+	    break;
+	 }
+
+	 types[count] = entry->d_type;
+
+	 /* directories are stat'ed through their descriptor when scanned */
+	 if (entry->d_type == DT_DIR)
+	 {
+	    res[count++] = -EAGAIN;
+	    continue;
+	 }
+
+	 /* URING_DEPTH entries always fit in the drained queue */
+	 struct io_uring_sqe* sqe = uring_get_sqe(ring);
+
+	 uring_prep_statx(sqe, dirfd(d), names[count],
+			  dir->src_flags | AT_SYMLINK_NOFOLLOW,
+			  entry->d_type == DT_REG ? MASK_REGULAR :
+			  entry->d_type == DT_UNKNOWN ? MASK_UNKNOWN : MASK_SPECIAL,
+			  &stx[count]);
+	 sqe->user_data = count;
+	 res[count++] = -EAGAIN;
+	 submitted++;
+      }
+      more = entry != NULL;
+
+      int taken = submitted ? uring_submit(ring, submitted) : 0;
+      struct io_uring_cqe cqe;
+
+      /* every request taken writes into stx, wait for all of them */
+      for (x = 0; taken > 0 && x < (size_t)taken; x++)
+      {
+	 if (!uring_next_cqe(ring, &cqe, true))
+	 {
+	    /* the names and buffers may still be used by the kernel */
+	    err("io_uring wait failed");
+	    set_failed();
+	    return false;
+	 }
+	 res[cqe.user_data] = cqe.res;
+      }
+
+      /* entries not taken are stat'ed again by process_file() */
+      if (taken < (int)submitted)
+      {
+	 drop_ring();
+	 more = false;
+      }
+
+      for (x = 0; x < count; x++)
+      {
+	 if (result && !has_failed())
+	 {
+	    struct stat st;
+
+	    /* a failed statx is retried with fstatat(), which reports it */
+	    if (res[x] == 0)
+	       statx_to_stat(&stx[x], &st);
+
+	    result = process_file(dir, names[x], types[x],
+				  res[x] == 0 ? &st : NULL, NULL);
+	 }
+	 free(names[x]);
+      }
+   }
+
+   free(stx);
+   return result;
+}
+#endif
+
+/**
+ * A directory entry, for walking a directory in name order.
+ */
+struct sorted_entry
+{
+   char* name;
+   unsigned char type;
+};
+
+static int sorted_entry_compare(const void* a, const void* b)
+{
+   return strcmp(((const struct sorted_entry*)a)->name,
+		 ((const struct sorted_entry*)b)->name);
+}
+
+/**
+ * Compare a path component of length len against a name, in the same
+ * order as the manifest.
+ */
+static inline int component_compare(const char* component, size_t len,
+				    const char* name)
+{
+   size_t name_len = strlen(name);
+   int result = memcmp(component, name, len < name_len ? len : name_len);
+
+   if (result)
+      return result;
+
+   return len < name_len ? -1 : len > name_len;
+}
+
+/**
+ * Advance a cursor over the previous manifest records below a directory
+ * up to name, reporting the files that are gone on the way if asked to.
+ *
+ * @param key_len Length of the path of the directory in the manifest.
+ * @param name Next entry of the directory, or NULL to run to the end.
+ * @return true if name is in the manifest, filling in prev.
+ */
+static bool merge_next(size_t key_len, size_t* cursor, size_t end,
+		       const char* name, struct manifest_entry* prev,
+		       bool report)
+{
+   char buffer[PATH_MAX+1];
+
+   while (*cursor < end)
+   {
+      struct manifest_entry entry;
+      size_t len;
+      const char* path = manifest_get(prev_manifest, *cursor, &len, &entry);
+
+      if (!path)
+      {
+	 (*cursor)++;
+	 continue;
+      }
+
+      const char* rest = key_len ? path + key_len + 1 : path;
+      size_t rest_len = len - (rest - path);
+      const char* slash = (const char*)memchr(rest, '/', rest_len);
+      size_t component_len = slash ? (size_t)(slash - rest) : rest_len;
+      int cmp = name ? component_compare(rest, component_len, name) : -1;
+
+      /* name is new, or was a directory in the previous backup */
+      if (cmp > 0 || (cmp == 0 && slash))
+	 return false;
+
+      if (cmp == 0)
+      {
+	 (*cursor)++;
+	 *prev = entry;
+	 return true;
+      }
+
+      if (slash)
+      {
+	 /* skip a whole subdirectory in one go */
+	 size_t begin, sub_end;
+	 size_t sub_len = slash - path;
+
+	 if (sub_len > PATH_MAX)
+	 {
+	    (*cursor)++;
+	    continue;
+	 }
+
+	 memcpy(buffer, path, sub_len);
+	 buffer[sub_len] = 0;
+	 manifest_range(prev_manifest, buffer, &begin, &sub_end);
+	 *cursor = sub_end > *cursor ? sub_end : *cursor + 1;
+      }
+      else
+      {
+	 if (report)
+	    info("gone %.*s", (int)len, path);
+	 (*cursor)++;
+      }
+   }
+
+   return false;
+}
+
+/**
+ * Read the entries of a directory, for sorting.
+ *
+ * @return false if out of memory, with what was read so far.
+ */
+static bool read_entries(DIR* d, struct sorted_entry** entries, size_t* count)
+{
+   size_t size = 0;
+   struct dirent* entry;
+
+   *entries = NULL;
+   *count = 0;
+
+   while ((entry = readdir(d)))
+   {
+      if (ignore_dir(entry->d_name))
+	 continue;
+
+      if (*count == size)
+      {
+	 size_t n = size ? size * 2 : 64;
+	 struct sorted_entry* e = (struct sorted_entry*)
+	    realloc(*entries, n * sizeof(**entries));
+
+	 if (!e)
+	    return false;
+
+	 *entries = e;
+	 size = n;
+      }
+
+      if (!((*entries)[*count].name = strdup(entry->d_name)))
+	 return false;
+      (*entries)[(*count)++].type = entry->d_type;
+   }
+
+   return true;
+}
+
+/**
+ * Process the entries of an open directory in name order, merged against
+ * the previous manifest in a single pass: each file comes out new,
+ * unchanged or modified, and what is left over in the manifest is gone.
+ * Only the directory being walked is held in memory.
+ */
+static bool scan_sorted(DIR* d, struct dir_node* dir)
+{
+   struct sorted_entry* entries;
+   size_t count;
+   size_t x;
+   bool result = read_entries(d, &entries, &count);
+
+   if (!result)
+      err("out of memory");
+
+   qsort(entries, count, sizeof(*entries), sorted_entry_compare);
+
+   const char* key = dir->path;
+   while (*key == '/')
+      key++;
+
+   size_t key_len = strlen(key);
+   size_t cursor, end;
+
+   manifest_range(prev_manifest, key, &cursor, &end);
+   dir->joined = true;
+
+   for (x = 0; x < count; x++)
+   {
+      if (result && !has_failed())
+      {
+	 struct manifest_entry prev;
+	 bool found = merge_next(key_len, &cursor, end, entries[x].name,
+				 &prev, true);
+
+	 result = process_file(dir, entries[x].name, entries[x].type, NULL,
+			       found ? &prev : NULL);
+      }
+      free(entries[x].name);
+   }
+
+   if (result && verbose)
+      merge_next(key_len, &cursor, end, NULL, NULL, true);
+
+   free(entries);
+   return result;
+}
+
+/**
+ * What subtree_unchanged() found for a directory below one that changed,
+ * kept for when scan_dir() gets to it so no subtree is walked twice.
+ */
+struct subtree_result
+{
+   struct subtree_result* next;
+   bool unchanged;
+   char path[];
+};
+
+#define SUBTREE_BUCKETS 1024
+
+static struct subtree_result* subtree_results[SUBTREE_BUCKETS];
+static pthread_mutex_t subtree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t subtree_bucket(const char* path)
+{
+   uint32_t hash = 2166136261U;
+
+   while (*path)
+      hash = (hash ^ (unsigned char)*path++) * 16777619U;
+
+   return hash % SUBTREE_BUCKETS;
+}
+
+/**
+ * Keep the results for the subdirectories of a directory that changed.
+ */
+static void publish_subtree_results(struct subtree_result* list)
+{
+   pthread_mutex_lock(&subtree_lock);
+   while (list)
+   {
+      struct subtree_result* next = list->next;
+      size_t bucket = subtree_bucket(list->path);
+
+      list->next = subtree_results[bucket];
+      subtree_results[bucket] = list;
+      list = next;
+   }
+   pthread_mutex_unlock(&subtree_lock);
+}
+
+/**
+ * Take the kept result for a directory.
+ *
+ * @return 1 if unchanged, 0 if changed and -1 if it was not checked.
+ */
+static int take_subtree_result(const char* path)
+{
+   struct subtree_result** p;
+   int result = -1;
+
+   pthread_mutex_lock(&subtree_lock);
+   for (p = &subtree_results[subtree_bucket(path)]; *p; p = &(*p)->next)
+   {
+      if (!strcmp((*p)->path, path))
+      {
+	 struct subtree_result* found = *p;
+
+	 *p = found->next;
+	 result = found->unchanged;
+	 free(found);
+	 break;
+      }
+   }
+   pthread_mutex_unlock(&subtree_lock);
+
+   return result;
+}
+
+static void free_subtree_results(struct subtree_result* list)
+{
+   while (list)
+   {
+      struct subtree_result* next = list->next;
+
+      free(list);
+      list = next;
+   }
+}
+
+/**
+ * Whether nothing below an open source directory changed since the
+ * previous manifest. Files are compared by size, mtime and mode, other
+ * entries by mode and change time. The result is worked out bottom-up:
+ * when the directory changed, what was found for its subdirectories is
+ * kept for scan_dir(), so each directory is walked at most once. With
+ * --sorted the listing is merged against the directory's records like
+ * scan_sorted() does, otherwise the entries are looked up.
+ *
+ * @param path Source path of the directory.
+ * @param prev The directory in the previous manifest.
+ */
+static bool subtree_unchanged(int fd, const char* path, const struct stat* s,
+			      int flags, const struct manifest_entry* prev)
+{
+   struct subtree_result* children = NULL;
+   struct sorted_entry* entries = NULL;
+   size_t count = 0;
+   size_t cursor = 0;
+   size_t end = 0;
+   size_t x;
+   bool result = true;
+
+   if (!S_ISDIR(prev->mode) || prev->mode != s->st_mode ||
+       entry_changed(s, prev))
+      return false;
+
+   int dup_fd = dup(fd);
+   DIR* d = dup_fd == -1 ? NULL : fdopendir(dup_fd);
+
+   if (!d)
+   {
+      if (dup_fd != -1)
+	 close(dup_fd);
+      return false;
+   }
+
+   const char* dir_key = path;
+   while (*dir_key == '/')
+      dir_key++;
+
+   size_t key_len = strlen(dir_key);
+
+   result = read_entries(d, &entries, &count);
+
+   if (sorted_scan)
+   {
+      qsort(entries, count, sizeof(*entries), sorted_entry_compare);
+      manifest_range(prev_manifest, dir_key, &cursor, &end);
+   }
+
+   for (x = 0; result && x < count; x++)
+   {
+      char buffer[PATH_MAX+1];
+      const char* name = entries[x].name;
+      unsigned char type = entries[x].type;
+      const char* source;
+      const char* key;
+      struct manifest_entry e;
+      struct stat st;
+
+      source = entry_path(buffer, sizeof(buffer), path, name);
+      for (key = source; *key == '/'; key++)
+	 ;
+
+      /* whatever it excludes is not in the stored copy either */
+      if (exclude_pattern && !fnmatch(exclude_pattern,source,0))
+	 result = false;
+      else if (stat_at(fd, name, flags | AT_SYMLINK_NOFOLLOW,
+		       type == DT_REG ? MASK_REGULAR :
+		       type == DT_DIR ? MASK_REGULAR : MASK_UNKNOWN,
+		       &st) < 0 ||
+	       !(sorted_scan ?
+		 merge_next(key_len, &cursor, end, name, &e, false) :
+		 manifest_lookup(prev_manifest, key, &e)) ||
+	       e.mode != st.st_mode)
+	 result = false;
+      else if (S_ISREG(st.st_mode))
+	 result = !entry_changed(&st, &e) && !foreign_recipe(&e);
+      else if (S_ISDIR(st.st_mode))
+      {
+	 int sub = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+	 struct subtree_result* child =
+	    (struct subtree_result*)malloc(sizeof(*child) + strlen(source) + 1);
+
+	 result = sub != -1 && subtree_unchanged(sub, source, &st, flags, &e);
+
+	 if (sub != -1)
+	    close(sub);
+
+	 if (child)
+	 {
+	    strcpy(child->path, source);
+	    child->unchanged = result;
+	    child->next = children;
+	    children = child;
 	 }
       }
+      else
+	 result = e.mtime_ns == stat_ctime_ns(&st);
+   }
+
+   for (x = 0; x < count; x++)
+      free(entries[x].name);
+   free(entries);
+
+   /* the offset is shared with fd, leave it where scan_dir() expects */
+   rewinddir(d);
+   closedir(d);
+
+   /* an unchanged directory is linked whole, so its children are not needed */
+   if (result)
+      free_subtree_results(children);
+   else
+      publish_subtree_results(children);
+
+   return result;
+}
+
+/**
+ * Replace a directory nothing changed under with a symlink to its stored
+ * copy, and carry its manifest records over. Finding that out takes a
+ * walk of the whole subtree by the thread that got to the directory
+ * before anything in it is handed out, so this is only done when asked
+ * for with --link-dirs.
+ *
+ * @param prev The directory in the previous manifest, when parent is joined.
+ * @return true if the symlink was made.
+ */
+static bool link_subtree(struct dir_node* parent, struct dir_node* dir,
+			 const char* name, const struct manifest_entry* prev)
+{
+   struct manifest_entry entry;
+   const char* root;
+   const char* key = dir->path;
+
+   /* hard links promise real directories */
+   if (!link_dirs || !prev_manifest || force_copy || link_mode != LINK_SYMLINK)
+      return false;
+
+   while (*key == '/')
+      key++;
+
+   /* a directory already checked along with its parent is not walked again */
+   int known = take_subtree_result(dir->path);
+
+   /* a joined parent merged the directory's record already */
+   if (prev)
+      entry = *prev;
+
+   if (!known || (!prev && (parent->joined ||
+			    !manifest_lookup(prev_manifest, key, &entry))) ||
+       !(root = manifest_root(prev_manifest, entry.root)) ||
+       (known < 0 && !subtree_unchanged(dir->src_fd, dir->path, &dir->stat,
+					dir->src_flags, &entry)))
+      return false;
+
+   char* target = join_path(root, key);
+
+   if (!target || symlinkat(target, parent->dest_fd, name) < 0)
+   {
+      free(target);
+      return false;
+   }
+
+   info("mirror %s ...",target);
+   free(target);
+
+   size_t begin, end;
+
+   manifest_range(prev_manifest, key, &begin, &end);
+
+   /* the files in it count towards the backup all the same */
+   if (count_bytes)
+   {
+      off_t total = 0;
+      size_t x;
+
+      for (x = begin; x < end; x++)
+      {
+	 struct manifest_entry e;
+	 size_t len;
+
+	 if (manifest_get(prev_manifest, x, &len, &e) && S_ISREG(e.mode))
+	    total += e.size;
+      }
+
+      __atomic_add_fetch(&total_bytes, total, __ATOMIC_RELAXED);
+   }
+
+   if (new_manifest)
+   {
+      if (!manifest_add(new_manifest, key, &entry) ||
+	  !manifest_add_range(new_manifest, prev_manifest, begin, end))
+      {
+	 err("out of memory");
+	 set_failed();
+      }
+   }
+
+   return true;
+}
+
+/**
+ * Record a directory created in this backup in the new manifest.
+ */
+static bool add_dir_entry(struct dir_node* dir)
+{
+   struct manifest_entry entry;
+   const char* key = dir->path;
+
+   while (*key == '/')
+      key++;
+
+   memset(&entry, 0, sizeof(entry));
+   entry.size = dir->stat.st_size;
+   entry.mtime_ns = stat_mtime_ns(&dir->stat);
+   entry.ino = dir->stat.st_ino;
+   entry.mode = dir->stat.st_mode;
+   entry.root = dest_root;
+
+   return manifest_add(new_manifest, key, &entry);
+}
+
+/**
+ * Record an entry other than a file or directory in the new manifest,
+ * with its change time, which chmod and chown touch.
+ */
+static bool add_special_entry(const char* source, const struct stat* s)
+{
+   struct manifest_entry entry;
+   const char* key = source;
+
+   while (*key == '/')
+      key++;
+
+   memset(&entry, 0, sizeof(entry));
+   entry.size = s->st_size;
+   entry.mtime_ns = stat_ctime_ns(s);
+   entry.ino = s->st_ino;
+   entry.mode = s->st_mode;
+   entry.root = dest_root;
+
+   return manifest_add(new_manifest, key, &entry);
+}
+
+/**
+ * Create a destination directory and process everything in it.
+ *
+ * @param prev The directory in the previous manifest, when parent is joined.
+ */
+static bool scan_dir(struct dir_node* parent, const char* name,
+		     const struct stat* source_stat,
+		     const struct manifest_entry* prev)
+{
+   bool result = true;
+   char buffer[PATH_MAX+1];
+   const char* source = entry_path(buffer, sizeof(buffer), parent->path, name);
+   struct dir_node* dir = alloc_dir_node(source, parent);
+
+   if (!dir)
+   {
+      err("out of memory");
+      return false;
+   }
+
+   dir_ref(parent);
+
+   /* without a stat from the caller, take it from what was opened */
+   dir->src_fd = openat(parent->src_fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+
+   if (source_stat)
+      dir->stat = *source_stat;
+   else if (dir->src_fd != -1 && fstat(dir->src_fd, &dir->stat) < 0)
+      close(dir->src_fd), dir->src_fd = -1;
+
+   /* crossed into another filesystem */
+   if (dir->src_fd != -1 && dir->stat.st_dev != parent->stat.st_dev)
+      dir->src_flags = statx_flags(dir->src_fd);
+
+   if (dir->src_fd == -1)
+   {
+      err("could not open directory %s", source);
+      set_failed();
+      dir_release(dir);
+      return false;
+   }
+
+   if (link_subtree(parent, dir, name, prev))
+   {
+      dir->apply_stat = false;
+      dir_release(dir);
+      return true;
+   }
+
+   if (new_manifest && !add_dir_entry(dir))
+   {
+      err("out of memory");
+      set_failed();
+      dir_release(dir);
+      return false;
+   }
+
+   dir->stat.st_mode |= S_IRWXU;
+
+   if (mkdirat(parent->dest_fd, name, dir->stat.st_mode) < 0 && errno != EEXIST)
+   {
+      err("cannot create directory %s", source);
+      set_failed();
+      dir_release(dir);
+      return false;
+   }
+
+   info("mkdir %s",source);
+
+   dir->dest_fd = openat(parent->dest_fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+
+   if (parent->prev_fd != -1)
+   {
+      dir->prev_fd = openat(parent->prev_fd, name, O_RDONLY|O_DIRECTORY);
+      if (dir->prev_fd != -1)
+	 dir->prev_path = join_path(parent->prev_path, name);
+   }
+
+   int fd = dup(dir->src_fd);
+   DIR* d = fd == -1 ? NULL : fdopendir(fd);
+
+   if (!d || dir->dest_fd == -1)
+   {
+      err("could not open directory %s", source);
+      if (fd != -1 && !d)
+	 close(fd);
+      result = false;
+   }
+   else if (sorted_scan && prev_manifest)
+   {
+      result = scan_sorted(d, dir);
+   }
+   else
+   {
+#ifdef HAVE_IO_URING
+      struct uring* ring = get_ring();
+
+      if (ring)
+	 result = scan_entries_uring(ring, d, dir);
+#endif
+
+      struct dirent* entry;
+      while (result && !has_failed() && (entry = readdir(d)))
+      {
+	 if (ignore_dir(entry->d_name))
+	    continue;
+
+	 result = process_file(dir, entry->d_name, entry->d_type, NULL, NULL);
+      }
+   }
+
+   if (d)
+      closedir(d);
+
+   /* the directory's stat is applied once its files are written */
+   if (!result)
+      set_failed();
+   dir_release(dir);
+
+   return result;
+}
+
+/**
+ * Queue a directory for the traversal threads, on the calling thread's
+ * own deque when it has one.
+ */
+static void push_dir(struct dir_node* parent, const char* name,
+		     const struct stat* source_stat,
+		     const struct manifest_entry* prev)
+{
+   struct scan_deque* deque = own_deque ? own_deque : &deques[0];
+   struct dir_item* item = (struct dir_item*)malloc(sizeof(*item));
+
+   if (!item || !(item->name = strdup(name)))
+   {
+      err("out of memory");
+      free(item);
+      set_failed();
+      return;
+   }
+
+   item->has_stat = source_stat != NULL;
+   if (source_stat)
+      item->stat = *source_stat;
+   item->has_prev = prev != NULL;
+   if (prev)
+      item->prev = *prev;
+   item->parent = parent;
+   dir_ref(parent);
+
+   __atomic_add_fetch(&scan_pending, 1, __ATOMIC_SEQ_CST);
+
+   pthread_mutex_lock(&deque->lock);
+   if (deque->bottom - deque->top == deque->size)
+   {
+      size_t size = deque->size ? deque->size * 2 : 64;
+      struct dir_item** items = (struct dir_item**)malloc(size * sizeof(*items));
+      size_t x;
+
+      if (!items)
+      {
+	 err("out of memory");
+	 exit(1);
+      }
+
+      for (x = deque->top; x != deque->bottom; x++)
+	 items[x & (size - 1)] = deque->items[x & (deque->size - 1)];
+
+      free(deque->items);
+      deque->items = items;
+      deque->size = size;
+   }
+   deque->items[deque->bottom++ & (deque->size - 1)] = item;
+   pthread_mutex_unlock(&deque->lock);
+
+   __atomic_add_fetch(&scan_queued, 1, __ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&scan_idle, __ATOMIC_SEQ_CST))
+   {
+      pthread_mutex_lock(&scan_lock);
+      pthread_cond_signal(&scan_wake);
+      pthread_mutex_unlock(&scan_lock);
+   }
+}
+
+static struct dir_item* pop_dir(struct scan_deque* deque, bool steal)
+{
+   struct dir_item* item = NULL;
+
+   pthread_mutex_lock(&deque->lock);
+   if (deque->bottom != deque->top)
+   {
+      if (steal)
+	 item = deque->items[deque->top++ & (deque->size - 1)];
+      else
+	 item = deque->items[--deque->bottom & (deque->size - 1)];
+   }
+   pthread_mutex_unlock(&deque->lock);
+
+   if (item)
+      __atomic_sub_fetch(&scan_queued, 1, __ATOMIC_SEQ_CST);
+
+   return item;
+}
+
+/**
+ * Mark one pushed directory (or main()'s hold) as done, waking every
+ * traversal thread when nothing is left.
+ */
+static void scan_done(void)
+{
+   if (__atomic_sub_fetch(&scan_pending, 1, __ATOMIC_SEQ_CST) == 0)
+   {
+      pthread_mutex_lock(&scan_lock);
+      pthread_cond_broadcast(&scan_wake);
+      pthread_mutex_unlock(&scan_lock);
+   }
+}
+
+static void* scan_worker(void* arg)
+{
+   int self = (int)(long)arg;
+   int x;
+
+   own_deque = &deques[self];
+
+   for (;;)
+   {
+      struct dir_item* item = pop_dir(own_deque, false);
+
+      for (x = 1; !item && x < scan_jobs; x++)
+	 item = pop_dir(&deques[(self + x) % scan_jobs], true);
+
+      if (item)
+      {
+	 if (!has_failed() &&
+	     !scan_dir(item->parent, item->name, item->has_stat ? &item->stat : NULL,
+		       item->has_prev ? &item->prev : NULL))
+	    set_failed();
+
+	 dir_release(item->parent);
+	 free(item->name);
+	 free(item);
+	 scan_done();
+	 continue;
+      }
+
+      pthread_mutex_lock(&scan_lock);
+      __atomic_add_fetch(&scan_idle, 1, __ATOMIC_SEQ_CST);
+      while (!__atomic_load_n(&scan_queued, __ATOMIC_SEQ_CST) &&
+	     __atomic_load_n(&scan_pending, __ATOMIC_SEQ_CST))
+	 pthread_cond_wait(&scan_wake, &scan_lock);
+      __atomic_sub_fetch(&scan_idle, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&scan_lock);
+
+      if (!__atomic_load_n(&scan_pending, __ATOMIC_SEQ_CST))
+	 break;
+   }
+
+   thread_cleanup();
+   return NULL;
+}
+
+/**
+ * Start the traversal threads. main() holds one pending count until all
+ * sources are queued so the threads do not stop early.
+ */
+static pthread_t* start_scanners(int count)
+{
+   pthread_t* threads = (pthread_t*)calloc(count, sizeof(pthread_t));
+   int x;
+
+   deques = (struct scan_deque*)calloc(count, sizeof(struct scan_deque));
+
+   if (!threads || !deques)
+   {
+      err("out of memory");
+      exit(1);
+   }
+
+   scan_pending = 1;
+
+   for (x = 0; x < count; x++)
+      pthread_mutex_init(&deques[x].lock, NULL);
+
+   for (x = 0; x < count; x++)
+   {
+      if (pthread_create(&threads[x], NULL, scan_worker, (void*)(long)x))
+      {
+	 err("could not start traversal thread");
+	 exit(1);
+      }
+   }
+
+   return threads;
+}
+
+/**
+ * Drop main()'s hold and wait for the traversal to finish.
+ */
+static void stop_scanners(pthread_t* threads, int count)
+{
+   int x;
+
+   scan_done();
+
+   for (x = 0; x < count; x++)
+      pthread_join(threads[x], NULL);
+
+   /* a thread still looking for work can steal from any deque */
+   for (x = 0; x < count; x++)
+   {
+      free(deques[x].items);
+      pthread_mutex_destroy(&deques[x].lock);
+   }
+
+   free(threads);
+   free(deques);
+   deques = NULL;
+}
+
+/**
+ * Process a file (or directory, or symlink, etc).
+ *
+ * Regular files are handed to the copy workers and directories to the
+ * traversal threads, so on return they may not be done yet. Failures
+ * are recorded with set_failed().
+ *
+ * Directories reported by readdir() are not stat'ed here; scan_dir()
+ * gets their stat information from the descriptor it opens anyway.
+ * Everything else is stat'ed with only the fields its type needs.
+ *
+ * @param parent Directory node of the containing directory.
+ * @param name Name of the file in parent.
+ * @param type d_type from readdir(), or DT_UNKNOWN.
+ * @param known_stat lstat() information of the file if already known, or NULL.
+ * @param prev The file in the previous manifest, when parent is joined.
+ */
+bool process_file(struct dir_node* parent, const char* name,
+		  unsigned char type, const struct stat* known_stat,
+		  const struct manifest_entry* prev)
+{
+   bool result = true;
+   struct stat source_stat;
+   char buffer[PATH_MAX+1];
+   const char* source = entry_path(buffer, sizeof(buffer), parent->path, name);
+
+   if (exclude_pattern && !fnmatch(exclude_pattern,source,0))
+      return true;
+
+   if (known_stat)
+      source_stat = *known_stat;
+
+   if (type == DT_DIR && !known_stat)
+   {
+      if (deques)
+	 push_dir(parent, name, NULL, prev);
+      else
+	 result = scan_dir(parent, name, NULL, prev);
+   }
+   else if (!known_stat &&
+	    stat_at(parent->src_fd, name, parent->src_flags | AT_SYMLINK_NOFOLLOW,
+		    type == DT_REG ? MASK_REGULAR :
+		    type == DT_UNKNOWN ? MASK_UNKNOWN : MASK_SPECIAL,
+		    &source_stat) < 0)
+   {
+      err("could not stat file %s", source);
+      result = false;
+   }
+   else
+   {
+      if (S_ISDIR(source_stat.st_mode))
+      {
+	 if (deques)
+	    push_dir(parent, name, &source_stat, prev);
+	 else
+	    result = scan_dir(parent, name, &source_stat, prev);
+      }
       else if (S_ISREG(source_stat.st_mode))
       {
 	 if (count_bytes)
 	 {
-	    total_bytes += source_stat.st_size;
+	    __atomic_add_fetch(&total_bytes, source_stat.st_size, __ATOMIC_RELAXED);
 	 }
 
-	 /*
-	  * If the current file has a different modification time than the previous file,
-	  * do a fresh copy, otherwise symlink to previous backup.
-	  */
-	 struct stat prev_stat;
-	 if (!prev_dest || force_copy || stat(prev_dest, &prev_stat) < 0 ||
-	     (source_stat.st_mtime != prev_stat.st_mtime))
-	 {
-	    result = copy_file(source,dest,&source_stat) && copy_time(dest,&source_stat);
+	 struct file_task* task = (struct file_task*)malloc(sizeof(*task));
 
-	    if (count_bytes)
-	    {
-	       bytes_copied += source_stat.st_size;
-	    }
-	 }
-	 else
+	 if (!task || !(task->name = strdup(name)))
 	 {
-	    result = symlink_file(prev_dest,dest);
+	    err("out of memory");
+	    free(task);
+	    return false;
 	 }
+
+	 task->stat = source_stat;
+	 task->dir = parent;
+	 task->split = NULL;
+	 task->has_prev = prev != NULL;
+	 if (prev)
+	    task->prev = *prev;
+	 dir_ref(parent);
+
+	 submit_task(task);
       }
       else if (S_ISBLK(source_stat.st_mode) || S_ISCHR(source_stat.st_mode) ||
 	       S_ISSOCK(source_stat.st_mode) || S_ISFIFO(source_stat.st_mode) ||
@@ -440,9 +4438,9 @@ bool process_file(const char* source, const char* root, const char* prev_root)
 
 	 if (S_ISFIFO(source_stat.st_mode))
 	 {
-	    if (mkfifo(dest, source_stat.st_mode) < 0)
+	    if (mkfifoat(parent->dest_fd, name, source_stat.st_mode) < 0)
 	    {
-	       err("cannot create fifo `%s'", dest);
+	       err("cannot create fifo `%s'", source);
 	       result = false;
 	    }
 	    else
@@ -452,22 +4450,23 @@ bool process_file(const char* source, const char* root, const char* prev_root)
 	 }
 	 else if (S_ISLNK(source_stat.st_mode))
 	 {
-	    char buffer[PATH_MAX+1];
-	    memset(buffer,0,sizeof(buffer));
+	    char link[PATH_MAX+1];
+	    memset(link,0,sizeof(link));
 
-	    if (readlink(source,buffer,PATH_MAX) == -1)
+	    if (readlinkat(parent->src_fd,name,link,PATH_MAX) == -1)
 	    {
 	       err("cannot read symlink `%s'", source);
 	       result = false;
 	    }
-	    else if (symlink(buffer, dest) < 0)
+	    else if (symlinkat(link, parent->dest_fd, name) < 0)
 	    {
-	       err("cannot create symlink `%s'", dest);
+	       err("cannot create symlink `%s'", source);
 	       result = false;
 	    }
-	    else if (lchown(dest, source_stat.st_uid, source_stat.st_gid) < 0)
+	    else if (fchownat(parent->dest_fd, name, source_stat.st_uid,
+			      source_stat.st_gid, AT_SYMLINK_NOFOLLOW) < 0)
 	    {
-	       err("unable to preserve ownership of `%s'", dest);
+	       err("unable to preserve ownership of `%s'", source);
 	       result = false;
 	    }
 	    else
@@ -477,9 +4476,10 @@ bool process_file(const char* source, const char* root, const char* prev_root)
 	 }
 	 else
 	 {
-	    if (mknod(dest, source_stat.st_mode, source_stat.st_rdev) < 0)
+	    if (mknodat(parent->dest_fd, name, source_stat.st_mode,
+			source_stat.st_rdev) < 0)
 	    {
-	       err("unable to create node `%s'", dest);
+	       err("unable to create node `%s'", source);
 	       result = false;
 	    }
 	    else
@@ -494,11 +4494,106 @@ bool process_file(const char* source, const char* root, const char* prev_root)
 	 result = false;
       }
 
-      free(dest);
-      free(prev_dest);
+      /* recorded so an unchanged subtree holding it can be linked */
+      if (result && new_manifest && !S_ISDIR(source_stat.st_mode) &&
+	  !S_ISREG(source_stat.st_mode) && !add_special_entry(source, &source_stat))
+      {
+	 err("out of memory");
+	 result = false;
+      }
+   }
+
+   return result;
+}
+
+/**
+ * Process one SOURCE argument. The directory containing it is opened
+ * by path and becomes the parent node everything else is relative to.
+ *
+ * @param root Path to the backup destination directory.
+ * @param prev_root Optional path to a previous backup destination directory.
+ */
+static bool process_source(const char* source, const char* root,
+			   const char* prev_root)
+{
+   bool result = true;
+   char* path = strdup(source);
+   const char* name;
+
+   if (!path)
+   {
+      err("out of memory");
+      return false;
+   }
+
+   size_t len = strlen(path);
+   while (len > 1 && path[len-1] == '/')
+      path[--len] = 0;
+
+   char* slash = strrchr(path, '/');
+
+   if (!slash)
+   {
+      name = strdup(path);
+      *path = 0;
+   }
+   else
+   {
+      name = strdup(*(slash+1) ? slash+1 : ".");
+      *(slash == path ? slash+1 : slash) = 0;
+   }
+
+   struct dir_node* top = alloc_dir_node(path, NULL);
+   char* dest = join_path(root, path);
 
+   if (!top || !name || !dest)
+   {
+      err("out of memory");
+      result = false;
+      goto done;
+   }
+
+   top->apply_stat = false;
+
+   if (rmkdir(dest, 0755) < 0 ||
+       (top->dest_fd = open(dest, O_RDONLY|O_DIRECTORY)) == -1)
+   {
+      err("could not create directory %s", dest);
+      result = false;
+      goto done;
+   }
+
+   if ((top->src_fd = open(*path ? path : ".", O_RDONLY|O_DIRECTORY)) == -1 ||
+       fstat(top->src_fd, &top->stat) < 0)
+   {
+      err("could not open directory %s", *path ? path : ".");
+      result = false;
+      goto done;
+   }
+
+   top->src_flags = statx_flags(top->src_fd);
+
+   /* the previous manifest stands in for the previous backup tree */
+   if (prev_root && !prev_manifest)
+   {
+      top->prev_path = join_path(prev_root, path);
+      if (top->prev_path)
+	 top->prev_fd = open(top->prev_path, O_RDONLY|O_DIRECTORY);
+      if (top->prev_fd != -1)
+      {
+	 top->prev_flags = statx_flags(top->prev_fd);
+	 top->prev_seconds = whole_seconds(top->prev_fd);
+      }
    }
 
+   result = process_file(top, name, DT_UNKNOWN, NULL, NULL);
+
+ done:
+   if (top)
+      dir_release(top);
+   free((char*)name);
+   free(dest);
+   free(path);
    return result;
 }
 
@@ -513,10 +4608,71 @@ static void usage(const char* base)
 	   "   -c,--count-bytes           Count the number of bytes copied compared to total backup.\n" \
 	   "   -d,--date-format=FORMAT    Set backup folder date format (default %s).\n" \
 	   "   -e,--exclude=PATTERN       Define exclude pattern to exlude files from snapshot.\n" \
+	   "   -b,--buffer-size=SIZE      Copy buffer size, suffix K, M or G (default adaptive, up to 1M).\n" \
+	   "   -j,--jobs=N                Copy files with N worker threads (default 1).\n" \
+	   "   -s,--scan-jobs=N           Walk directories with N threads (default 1).\n" \
+	   "   -u,--io-uring              Stat directory entries in batches with io_uring, and\n" \
+	   "                              copy files over 16K with queued reads and writes\n" \
+	   "                              where copy_file_range() cannot be used.\n" \
+	   "      --link-mode=MODE        Point unchanged files at their stored copy with a\n" \
+	   "                              symlink (default) or hard link.\n" \
+	   "      --link-dirs             Make directories nothing changed under since the\n" \
+	   "                              previous manifest a single symlink. Each is walked\n" \
+	   "                              in full by one thread first. Symlink mode only.\n" \
+	   "      --reflink[=WHEN]        Clone changed files on copy-on-write filesystems.\n" \
+	   "                              WHEN is auto (default), always or never.\n" \
+	   "      --sparse=WHEN           Leave holes in copies where the source has them\n" \
+	   "                              (auto, default), also for blocks of zeros (always)\n" \
+	   "                              or never.\n" \
+	   "      --writeback=SIZE        Write copies back to disk in windows of SIZE as they\n" \
+	   "                              are made rather than in bursts.\n" \
+	   "      --split=SIZE            Copy files of SIZE and up with --jobs threads, each\n" \
+	   "                              taking different parts of the file.\n" \
+	   "      --nocache               Keep backups out of the page cache and leave the\n" \
+	   "                              access times of sources alone.\n" \
+	   "      --no-manifest           Neither use nor write backup manifests.\n" \
+	   "      --store                 Keep changed files once per content in\n" \
+	   "                              DESTINATION/" STORE_DIR ", linking backups to them.\n" \
+	   "      --chunks                Keep files of 1M and up as chunks in DESTINATION/" CHUNK_DIR ",\n" \
+	   "                              with a recipe in the backup.\n" \
+	   "      --extract=RECIPE        Write the file a recipe describes to stdout.\n" \
+	   "      --delta                 Build changed files of 1M and up from the blocks of\n" \
+	   "                              their previous version that are unchanged, where\n" \
+	   "                              the destination can clone. Helps files edited in\n" \
+	   "                              place; after an insert the rest is copied.\n" \
+	   "      --blocks                Clone the previous version of changed files of 1M\n" \
+	   "                              and up and rewrite only the blocks that differ.\n" \
+	   "      --append                Copy only the new end of files that were appended\n" \
+	   "                              to, like logs, after checking the old data is\n" \
+	   "                              unchanged. Needs the manifest.\n" \
+	   "      --sorted                Walk directories in name order, merging them with\n" \
+	   "                              the previous manifest instead of looking files up.\n" \
 	   "\n",base,date_format);
 }
 
-const char short_options[] = "d:e:fvhc";
+/**
+ * Options without a short form.
+ */
+enum
+{
+   OPT_REFLINK = 256,
+   OPT_LINK_MODE,
+   OPT_LINK_DIRS,
+   OPT_NO_MANIFEST,
+   OPT_SORTED,
+   OPT_STORE,
+   OPT_CHUNKS,
+   OPT_EXTRACT,
+   OPT_DELTA,
+   OPT_APPEND,
+   OPT_BLOCKS,
+   OPT_SPARSE,
+   OPT_NOCACHE,
+   OPT_WRITEBACK,
+   OPT_SPLIT
+};
+
+const char short_options[] = "b:d:e:j:s:fvhcu";
 
 struct option long_options[] =
 {
@@ -525,7 +4681,26 @@ struct option long_options[] =
    { "date-format",  1, 0, 'd' },
    { "exclude",      1, 0, 'e' },
    { "count-bytes",  0, 0, 'c' },
+   { "buffer-size",  1, 0, 'b' },
+   { "jobs",         1, 0, 'j' },
+   { "scan-jobs",    1, 0, 's' },
+   { "io-uring",     0, 0, 'u' },
    { "help",         0, 0, 'h' },
+   { "reflink",      2, 0, OPT_REFLINK },
+   { "link-mode",    1, 0, OPT_LINK_MODE },
+   { "link-dirs",    0, 0, OPT_LINK_DIRS },
+   { "sparse",       1, 0, OPT_SPARSE },
+   { "nocache",      0, 0, OPT_NOCACHE },
+   { "writeback",    1, 0, OPT_WRITEBACK },
+   { "split",        1, 0, OPT_SPLIT },
+   { "no-manifest",  0, 0, OPT_NO_MANIFEST },
+   { "sorted",       0, 0, OPT_SORTED },
+   { "store",        0, 0, OPT_STORE },
+   { "chunks",       0, 0, OPT_CHUNKS },
+   { "extract",      1, 0, OPT_EXTRACT },
+   { "delta",        0, 0, OPT_DELTA },
+   { "append",       0, 0, OPT_APPEND },
+   { "blocks",       0, 0, OPT_BLOCKS },
    { 0,              0, 0, 0   }
 };
 
@@ -557,6 +4732,128 @@ int main(int argc, char** argv)
       case 'f':
 	 force_copy = true;
 	 break;
+      case 'b':
+	 buffer_size = parse_size(optarg);
+	 if (!buffer_size)
+	 {
+	    err("invalid buffer size `%s'", optarg);
+	    usage(argv[0]);
+	    return 1;
+	 }
+	 break;
+      case 'j':
+	 jobs = atoi(optarg);
+	 if (jobs < 1)
+	 {
+	    err("invalid number of jobs `%s'", optarg);
+	    usage(argv[0]);
+	    return 1;
+	 }
+	 break;
+      case 's':
+	 scan_jobs = atoi(optarg);
+	 if (scan_jobs < 1)
+	 {
+	    err("invalid number of scan jobs `%s'", optarg);
+	    usage(argv[0]);
+	    return 1;
+	 }
+	 break;
+      case 'u':
+#ifdef HAVE_IO_URING
+	 use_uring = true;
+#else
+	 err("built without io_uring support");
+	 return 1;
+#endif
+	 break;
+      case OPT_REFLINK:
+	 if (!optarg || !strcmp(optarg,"always"))
+	    reflink = REFLINK_ALWAYS;
+	 else if (!strcmp(optarg,"auto"))
+	    reflink = REFLINK_AUTO;
+	 else if (!strcmp(optarg,"never"))
+	    reflink = REFLINK_NEVER;
+	 else
+	 {
+	    err("invalid reflink mode `%s'", optarg);
+	    usage(argv[0]);
+	    return 1;
+	 }
+	 break;
+      case OPT_WRITEBACK:
+	 writeback_window = parse_size(optarg);
+	 if (!writeback_window)
+	 {
+	    err("invalid writeback window `%s'", optarg);
+	    usage(argv[0]);
+	    return 1;
+	 }
+	 break;
+      case OPT_SPLIT:
+	 split_size = parse_size(optarg);
+	 if (!split_size)
+	 {
+	    err("invalid split size `%s'", optarg);
+	    usage(argv[0]);
+	    return 1;
+	 }
+	 break;
+      case OPT_NOCACHE:
+	 nocache = true;
+	 break;
+      case OPT_SPARSE:
+	 if (!strcmp(optarg,"always"))
+	    sparse = SPARSE_ALWAYS;
+	 else if (!strcmp(optarg,"auto"))
+	    sparse = SPARSE_AUTO;
+	 else if (!strcmp(optarg,"never"))
+	    sparse = SPARSE_NEVER;
+	 else
+	 {
+	    err("invalid sparse mode `%s'", optarg);
+	    usage(argv[0]);
+	    return 1;
+	 }
+	 break;
+      case OPT_LINK_MODE:
+	 if (!strcmp(optarg,"symlink"))
+	    link_mode = LINK_SYMLINK;
+	 else if (!strcmp(optarg,"hard"))
+	    link_mode = LINK_HARD;
+	 else
+	 {
+	    err("invalid link mode `%s'", optarg);
+	    usage(argv[0]);
+	    return 1;
+	 }
+	 break;
+      case OPT_LINK_DIRS:
+	 link_dirs = true;
+	 break;
+      case OPT_NO_MANIFEST:
+	 use_manifest = false;
+	 break;
+      case OPT_SORTED:
+	 sorted_scan = true;
+	 break;
+      case OPT_STORE:
+	 use_store = true;
+	 break;
+      case OPT_CHUNKS:
+	 use_chunks = true;
+	 break;
+      case OPT_DELTA:
+	 use_delta = true;
+	 break;
+      case OPT_APPEND:
+	 use_append = true;
+	 break;
+      case OPT_BLOCKS:
+	 use_blocks = true;
+	 break;
+      case OPT_EXTRACT:
+	 return extract_recipe(optarg) ? 0 : 1;
       case 'h':
 	 usage(argv[0]);
 	 return 0;
@@ -573,6 +4870,14 @@ int main(int argc, char** argv)
       return 1;
    }
 
+   /* every directory being worked on holds three descriptors */
+   struct rlimit limit;
+   if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+   {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+   }
+
    const char* root = argv[argc-1];
    char* previous = locate_previous(root);
    char* dest = join_path(root,current_time(date_format));
@@ -605,22 +4910,86 @@ int main(int argc, char** argv)
       info("using previous backup at %s",previous);
    }
 
-   for (x = optind; x < argc-1;x++)
+   if (!use_chunks)
+   {
+      char* path = join_path(root, CHUNK_DIR);
+
+      old_recipes = path && access(path, F_OK) == 0;
+      free(path);
+   }
+
+   if ((use_store && (store_fd = open_store(root, STORE_DIR, &store_path)) == -1) ||
+       (use_chunks && (chunk_fd = open_store(root, CHUNK_DIR, &chunk_path)) == -1))
+   {
+      err("could not open store in %s",root);
+      result = 1;
+      goto done;
+   }
+
+   if (use_manifest)
    {
-      if (!process_file(argv[x],dest,previous))
+      if (previous)
       {
-	 result = 1;
-	 break;
+	 char* file = manifest_file(previous);
+
+	 if (file && (prev_manifest = manifest_open(file)))
+	 {
+	    info("using manifest %s",file);
+	    manifest_advise(prev_manifest, sorted_scan);
+	 }
+	 free(file);
       }
+
+      new_manifest = manifest_writer_new(prev_manifest, root);
+      if (new_manifest)
+	 dest_root = manifest_writer_root(new_manifest, dest);
+   }
+
+   pthread_t* workers = jobs > 1 ? start_workers(jobs) : NULL;
+   pthread_t* scanners = scan_jobs > 1 ? start_scanners(scan_jobs) : NULL;
+
+   for (x = optind; x < argc-1 && !has_failed();x++)
+   {
+      if (!process_source(argv[x],dest,previous))
+	 set_failed();
+   }
+
+   if (scanners)
+      stop_scanners(scanners, scan_jobs);
+
+   if (workers)
+      stop_workers(workers, jobs);
+
+   if (has_failed())
+      result = 1;
+
+   /* only a complete backup gets a manifest */
+   if (new_manifest && !result)
+   {
+      char* file = manifest_file(dest);
+
+      if (!file || !manifest_write(new_manifest, file))
+	 err("could not write manifest for %s",dest);
+      free(file);
    }
 
    if (count_bytes && !result)
    {
-      printf("Copied %d of %d bytes total in backup.\n",bytes_copied,total_bytes);
+      printf("Copied %lld of %lld bytes total in backup.\n",
+	     (long long)bytes_copied,(long long)total_bytes);
    }
 
  done:
 
+   thread_cleanup();
+   if (store_fd != -1)
+      close(store_fd);
+   free(store_path);
+   if (chunk_fd != -1)
+      close(chunk_fd);
+   free(chunk_path);
+   manifest_writer_free(new_manifest);
+   manifest_close(prev_manifest);
    free(previous);
    free(dest);
 
@@ -0,0 +1,1082 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+
+#define MANIFEST_MAGIC "ISNAPMF"
+#define MANIFEST_VERSION 4
+
+/* records and paths a writer holds before spilling them as a sorted run */
+#define MANIFEST_RUN_SIZE (32 * 1024 * 1024)
+
+/* buffer for each run being merged and each stream being written */
+#define MANIFEST_IO_SIZE (64 * 1024)
+
+/*
+ * On disk a manifest is the header, the root offset table, the records,
+ * the hash table and the string pool, all in host byte order. The hash
+ * table holds record index + 1, 0 for an empty bucket.
+ */
+struct manifest_header
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t roots;
+   uint64_t count;
+   uint64_t buckets;
+   uint64_t root_table;
+   uint64_t records;
+   uint64_t table;
+   uint64_t strings;
+   uint64_t strings_size;
+};
+
+struct manifest_record
+{
+   uint64_t hash;
+   uint64_t size;
+   int64_t mtime_ns;
+   uint64_t ino;
+   uint64_t path;
+   uint32_t path_len;
+   uint32_t mode;
+   uint32_t root;
+   uint32_t flags;
+   unsigned char digest[MANIFEST_DIGEST_SIZE];
+};
+
+struct manifest
+{
+   void* map;
+   size_t map_size;
+   const struct manifest_header* header;
+   const uint64_t* root_table;
+   const struct manifest_record* records;
+   const uint32_t* table;
+   const char* strings;
+};
+
+/**
+ * A sorted run of records in the spill file, each record followed by its
+ * path.
+ */
+struct manifest_run
+{
+   off_t offset;
+   size_t count;
+};
+
+struct manifest_writer
+{
+   /* records not spilled yet, with path an offset into strings */
+   struct manifest_record* records;
+   size_t count;
+   size_t size;
+   char* strings;
+   size_t strings_len;
+   size_t strings_size;
+   /* runs spilled to an unnamed file in dir, if there is a dir */
+   char* dir;
+   int spill_fd;
+   off_t spill_size;
+   struct manifest_run* runs;
+   size_t nruns;
+   /* everything recorded, spilled or not */
+   uint64_t total;
+   uint64_t total_strings;
+   char** roots;
+   bool* used_roots;
+   uint32_t nroots;
+   pthread_mutex_t lock;
+};
+
+/**
+ * FNV-1a, good enough to spread paths over the buckets.
+ */
+static uint64_t hash_path(const char* path, size_t len)
+{
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   size_t x;
+
+   for (x = 0; x < len; x++)
+   {
+      hash ^= (unsigned char)path[x];
+      hash *= 0x100000001b3ULL;
+   }
+
+   return hash;
+}
+
+/**
+ * Compare a and b in path order, at most n bytes.
+ */
+static int path_compare(const char* a, const char* b, size_t n)
+{
+   size_t x;
+
+   for (x = 0; x < n; x++)
+   {
+      int ca = a[x] == '/' ? 0 : (unsigned char)a[x] + 1;
+      int cb = b[x] == '/' ? 0 : (unsigned char)b[x] + 1;
+
+      if (ca != cb)
+	 return ca - cb;
+   }
+
+   return 0;
+}
+
+/**
+ * Compare whole paths a and b in path order.
+ */
+static int full_path_compare(const char* a, size_t a_len,
+			     const char* b, size_t b_len)
+{
+   int result = path_compare(a, b, a_len < b_len ? a_len : b_len);
+
+   if (result)
+      return result;
+
+   return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int record_compare(const void* a, const void* b, void* strings)
+{
+   const struct manifest_record* ra = (const struct manifest_record*)a;
+   const struct manifest_record* rb = (const struct manifest_record*)b;
+
+   return full_path_compare((const char*)strings + ra->path, ra->path_len,
+			    (const char*)strings + rb->path, rb->path_len);
+}
+
+static inline bool in_map(const struct manifest* manifest, uint64_t offset,
+			  uint64_t size)
+{
+   return offset <= manifest->map_size && size <= manifest->map_size - offset;
+}
+
+struct manifest* manifest_open(const char* file)
+{
+   struct manifest* manifest = NULL;
+   struct stat s;
+   int fd = open(file, O_RDONLY);
+
+   if (fd == -1)
+      return NULL;
+
+   if (fstat(fd, &s) < 0 || s.st_size < (off_t)sizeof(struct manifest_header))
+      goto done;
+
+   manifest = (struct manifest*)calloc(1, sizeof(*manifest));
+   if (!manifest)
+      goto done;
+
+   manifest->map_size = s.st_size;
+   manifest->map = mmap(NULL, manifest->map_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (manifest->map == MAP_FAILED)
+   {
+      free(manifest);
+      manifest = NULL;
+      goto done;
+   }
+
+   const struct manifest_header* h = (const struct manifest_header*)manifest->map;
+
+   if (memcmp(h->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) ||
+       h->version != MANIFEST_VERSION ||
+       !h->buckets || (h->buckets & (h->buckets - 1)) || h->count >= h->buckets ||
+       !in_map(manifest, h->root_table, h->roots * sizeof(uint64_t)) ||
+       !in_map(manifest, h->records, h->count * sizeof(struct manifest_record)) ||
+       !in_map(manifest, h->table, h->buckets * sizeof(uint32_t)) ||
+       !in_map(manifest, h->strings, h->strings_size))
+   {
+      manifest_close(manifest);
+      manifest = NULL;
+      goto done;
+   }
+
+   manifest->header = h;
+   manifest->root_table = (const uint64_t*)((const char*)manifest->map + h->root_table);
+   manifest->records = (const struct manifest_record*)((const char*)manifest->map + h->records);
+   manifest->table = (const uint32_t*)((const char*)manifest->map + h->table);
+   manifest->strings = (const char*)manifest->map + h->strings;
+
+   madvise(manifest->map, manifest->map_size, MADV_RANDOM);
+
+ done:
+   close(fd);
+   return manifest;
+}
+
+void manifest_close(struct manifest* manifest)
+{
+   if (manifest)
+   {
+      munmap(manifest->map, manifest->map_size);
+      free(manifest);
+   }
+}
+
+static const char* record_path(struct manifest* manifest,
+			       const struct manifest_record* r)
+{
+   if (r->path > manifest->header->strings_size ||
+       r->path_len > manifest->header->strings_size - r->path)
+      return NULL;
+
+   return manifest->strings + r->path;
+}
+
+static void record_entry(struct manifest* manifest,
+			 const struct manifest_record* r,
+			 struct manifest_entry* entry)
+{
+   entry->size = r->size;
+   entry->mtime_ns = r->mtime_ns;
+   entry->ino = r->ino;
+   entry->mode = r->mode;
+   entry->root = r->root < manifest->header->roots ? r->root : MANIFEST_NO_ROOT;
+   entry->flags = r->flags;
+   memcpy(entry->digest, r->digest, sizeof(entry->digest));
+}
+
+bool manifest_lookup(struct manifest* manifest, const char* path,
+		     struct manifest_entry* entry)
+{
+   size_t len = strlen(path);
+   uint64_t hash = hash_path(path, len);
+   uint64_t mask = manifest->header->buckets - 1;
+   uint64_t x;
+
+   for (x = hash & mask; manifest->table[x]; x = (x + 1) & mask)
+   {
+      uint64_t index = manifest->table[x] - 1;
+
+      if (index >= manifest->header->count)
+	 break;
+
+      const struct manifest_record* r = &manifest->records[index];
+      const char* p;
+
+      if (r->hash == hash && r->path_len == len &&
+	  (p = record_path(manifest, r)) && !memcmp(p, path, len))
+      {
+	 record_entry(manifest, r, entry);
+	 return true;
+      }
+   }
+
+   return false;
+}
+
+/**
+ * Compare record index against the directory prefix dir/ of length len:
+ * 0 if the record is below it.
+ */
+static int prefix_compare(struct manifest* manifest, size_t index,
+			  const char* dir, size_t len)
+{
+   const struct manifest_record* r = &manifest->records[index];
+   const char* path = record_path(manifest, r);
+   int result;
+
+   /* treat broken records as sorting first, they never match */
+   if (!path)
+      return -1;
+
+   result = path_compare(path, dir, r->path_len < len ? r->path_len : len);
+
+   if (result)
+      return result;
+
+   /* dir itself, or a prefix of it, comes before dir/ */
+   if (r->path_len <= len)
+      return -1;
+
+   return path[len] == '/' ? 0 : 1;
+}
+
+void manifest_range(struct manifest* manifest, const char* dir,
+		    size_t* begin, size_t* end)
+{
+   size_t len = strlen(dir);
+   size_t lo = 0;
+   size_t hi = manifest->header->count;
+
+   if (!len)
+   {
+      *begin = lo;
+      *end = hi;
+      return;
+   }
+
+   while (lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (prefix_compare(manifest, mid, dir, len) < 0)
+	 lo = mid + 1;
+      else
+	 hi = mid;
+   }
+
+   *begin = lo;
+   hi = manifest->header->count;
+
+   while (lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (prefix_compare(manifest, mid, dir, len) <= 0)
+	 lo = mid + 1;
+      else
+	 hi = mid;
+   }
+
+   *end = lo;
+}
+
+const char* manifest_get(struct manifest* manifest, size_t index,
+			 size_t* len, struct manifest_entry* entry)
+{
+   if (index >= manifest->header->count)
+      return NULL;
+
+   const struct manifest_record* r = &manifest->records[index];
+   const char* path = record_path(manifest, r);
+
+   if (path)
+   {
+      *len = r->path_len;
+      record_entry(manifest, r, entry);
+   }
+
+   return path;
+}
+
+void manifest_advise(struct manifest* manifest, bool sequential)
+{
+   madvise(manifest->map, manifest->map_size,
+	   sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+const char* manifest_root(struct manifest* manifest, uint32_t root)
+{
+   if (root >= manifest->header->roots)
+      return NULL;
+
+   uint64_t offset = manifest->root_table[root];
+
+   if (offset >= manifest->header->strings_size ||
+       !memchr(manifest->strings + offset, 0, manifest->header->strings_size - offset))
+      return NULL;
+
+   return manifest->strings + offset;
+}
+
+struct manifest_writer* manifest_writer_new(struct manifest* prev,
+					    const char* dir)
+{
+   struct manifest_writer* writer =
+      (struct manifest_writer*)calloc(1, sizeof(*writer));
+   uint32_t x;
+
+   if (!writer)
+      return NULL;
+
+   pthread_mutex_init(&writer->lock, NULL);
+   writer->spill_fd = -1;
+
+   if (dir && !(writer->dir = strdup(dir)))
+   {
+      manifest_writer_free(writer);
+      return NULL;
+   }
+
+   for (x = 0; prev && x < prev->header->roots; x++)
+   {
+      const char* root = manifest_root(prev, x);
+
+      /* keep the indexes lined up even for a broken root */
+      if (manifest_writer_root(writer, root ? root : "") != x)
+      {
+	 manifest_writer_free(writer);
+	 return NULL;
+      }
+   }
+
+   return writer;
+}
+
+uint32_t manifest_writer_root(struct manifest_writer* writer, const char* root)
+{
+   uint32_t x;
+
+   pthread_mutex_lock(&writer->lock);
+
+   for (x = 0; x < writer->nroots; x++)
+      if (!strcmp(writer->roots[x], root))
+	 goto done;
+
+   char** roots = (char**)realloc(writer->roots, (x + 1) * sizeof(char*));
+
+   if (roots)
+      writer->roots = roots;
+
+   bool* used = (bool*)realloc(writer->used_roots, (x + 1) * sizeof(bool));
+
+   if (used)
+      writer->used_roots = used;
+
+   if (!roots || !used || !(roots[x] = strdup(root)))
+   {
+      x = MANIFEST_NO_ROOT;
+      goto done;
+   }
+
+   used[x] = false;
+   writer->nroots++;
+
+ done:
+   pthread_mutex_unlock(&writer->lock);
+   return x;
+}
+
+/**
+ * Open an unnamed file in dir for the runs.
+ */
+static int open_spill(const char* dir)
+{
+   int fd = -1;
+
+#ifdef O_TMPFILE
+   fd = open(dir, O_TMPFILE|O_RDWR, 0600);
+#endif
+
+   /* filesystems without O_TMPFILE get a file that is removed at once */
+   if (fd == -1)
+   {
+      size_t len = strlen(dir);
+      char* name = (char*)malloc(len + sizeof("/.manifest-XXXXXX"));
+
+      if (!name)
+	 return -1;
+
+      memcpy(name, dir, len);
+      memcpy(name + len, "/.manifest-XXXXXX", sizeof("/.manifest-XXXXXX"));
+
+      if ((fd = mkstemp(name)) != -1)
+	 unlink(name);
+      free(name);
+   }
+
+   return fd;
+}
+
+/**
+ * Sort the records in memory and append them to the spill file as a run,
+ * with the writer locked.
+ */
+static bool spill_run(struct manifest_writer* writer)
+{
+   struct manifest_run* runs;
+   FILE* out;
+   size_t x;
+   int fd;
+
+   if (writer->spill_fd == -1 && (writer->spill_fd = open_spill(writer->dir)) == -1)
+      return false;
+
+   runs = (struct manifest_run*)realloc(writer->runs,
+					(writer->nruns + 1) * sizeof(*runs));
+   if (!runs)
+      return false;
+   writer->runs = runs;
+
+   /* only runs are ever written, so the offset is always at the end */
+   if ((fd = dup(writer->spill_fd)) == -1)
+      return false;
+
+   if (!(out = fdopen(fd, "w")))
+   {
+      close(fd);
+      return false;
+   }
+
+   qsort_r(writer->records, writer->count, sizeof(struct manifest_record),
+	   record_compare, writer->strings);
+
+   bool ok = true;
+
+   for (x = 0; ok && x < writer->count; x++)
+   {
+      const struct manifest_record* r = &writer->records[x];
+
+      ok = fwrite(r, sizeof(*r), 1, out) == 1 &&
+	 fwrite(writer->strings + r->path, 1, r->path_len, out) == r->path_len;
+   }
+
+   ok = fclose(out) == 0 && ok;
+   if (!ok)
+      return false;
+
+   runs[writer->nruns].offset = writer->spill_size;
+   runs[writer->nruns++].count = writer->count;
+   writer->spill_size += writer->count * sizeof(struct manifest_record) +
+      writer->strings_len;
+   writer->count = 0;
+   writer->strings_len = 0;
+   return true;
+}
+
+/**
+ * Append a record, with the writer locked.
+ */
+static bool add_record(struct manifest_writer* writer, const char* path,
+		       size_t len, const struct manifest_entry* entry)
+{
+   if (writer->dir && writer->count &&
+       writer->count * sizeof(struct manifest_record) + writer->strings_len +
+       len > MANIFEST_RUN_SIZE && !spill_run(writer))
+      return false;
+
+   if (writer->count == writer->size)
+   {
+      size_t size = writer->size ? writer->size * 2 : 1024;
+      struct manifest_record* records = (struct manifest_record*)
+	 realloc(writer->records, size * sizeof(*records));
+
+      if (!records)
+	 return false;
+
+      writer->records = records;
+      writer->size = size;
+   }
+
+   if (writer->strings_len + len > writer->strings_size)
+   {
+      size_t size = writer->strings_size ? writer->strings_size * 2 : 65536;
+      char* strings;
+
+      while (size < writer->strings_len + len)
+	 size *= 2;
+
+      if (!(strings = (char*)realloc(writer->strings, size)))
+	 return false;
+
+      writer->strings = strings;
+      writer->strings_size = size;
+   }
+
+   struct manifest_record* r = &writer->records[writer->count++];
+
+   memset(r, 0, sizeof(*r));
+   r->hash = hash_path(path, len);
+   r->size = entry->size;
+   r->mtime_ns = entry->mtime_ns;
+   r->ino = entry->ino;
+   r->mode = entry->mode;
+   r->root = entry->root;
+   r->flags = entry->flags;
+   memcpy(r->digest, entry->digest, sizeof(r->digest));
+   r->path = writer->strings_len;
+   r->path_len = len;
+
+   memcpy(writer->strings + writer->strings_len, path, len);
+   writer->strings_len += len;
+
+   if (entry->root < writer->nroots)
+      writer->used_roots[entry->root] = true;
+   writer->total++;
+   writer->total_strings += len;
+   return true;
+}
+
+bool manifest_add(struct manifest_writer* writer, const char* path,
+		  const struct manifest_entry* entry)
+{
+   bool result;
+
+   pthread_mutex_lock(&writer->lock);
+   result = add_record(writer, path, strlen(path), entry);
+   pthread_mutex_unlock(&writer->lock);
+
+   return result;
+}
+
+bool manifest_add_range(struct manifest_writer* writer,
+			struct manifest* manifest, size_t begin, size_t end)
+{
+   bool result = true;
+   size_t x;
+
+   pthread_mutex_lock(&writer->lock);
+
+   for (x = begin; x < end && result; x++)
+   {
+      struct manifest_entry entry;
+      size_t len;
+      const char* path = manifest_get(manifest, x, &len, &entry);
+
+      if (path)
+	 result = add_record(writer, path, len, &entry);
+   }
+
+   pthread_mutex_unlock(&writer->lock);
+
+   return result;
+}
+
+/**
+ * Reads the records of a run back from the spill file, one at a time.
+ */
+struct run_reader
+{
+   off_t offset;
+   size_t left;
+   char* data;
+   size_t size;
+   size_t len;
+   size_t pos;
+   /* the current record and its path, valid until the next one */
+   struct manifest_record record;
+   const char* path;
+};
+
+/**
+ * Have at least need bytes from pos on in the reader's buffer.
+ */
+static bool run_fill(struct run_reader* reader, int fd, size_t need)
+{
+   if (reader->len - reader->pos >= need)
+      return true;
+
+   memmove(reader->data, reader->data + reader->pos, reader->len - reader->pos);
+   reader->len -= reader->pos;
+   reader->pos = 0;
+
+   if (need > reader->size)
+   {
+      char* data = (char*)realloc(reader->data, need);
+
+      if (!data)
+	 return false;
+
+      reader->data = data;
+      reader->size = need;
+   }
+
+   while (reader->len < need)
+   {
+      ssize_t bytes = pread(fd, reader->data + reader->len,
+			    reader->size - reader->len, reader->offset);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      if (bytes <= 0)
+	 return false;
+
+      reader->len += bytes;
+      reader->offset += bytes;
+   }
+
+   return true;
+}
+
+/**
+ * Move to the next record of a run.
+ *
+ * @return false at the end of the run, or on a read error with *error set.
+ */
+static bool run_next(struct run_reader* reader, int fd, bool* error)
+{
+   if (reader->path)
+      reader->pos += sizeof(reader->record) + reader->record.path_len;
+   reader->path = NULL;
+
+   if (!reader->left)
+      return false;
+
+   if (!run_fill(reader, fd, sizeof(reader->record)))
+   {
+      *error = true;
+      return false;
+   }
+
+   memcpy(&reader->record, reader->data + reader->pos, sizeof(reader->record));
+
+   if (!run_fill(reader, fd, sizeof(reader->record) + reader->record.path_len))
+   {
+      *error = true;
+      return false;
+   }
+
+   reader->path = reader->data + reader->pos + sizeof(reader->record);
+   reader->left--;
+   return true;
+}
+
+static inline bool reader_less(const struct run_reader* a,
+			       const struct run_reader* b)
+{
+   return full_path_compare(a->path, a->record.path_len,
+			    b->path, b->record.path_len) < 0;
+}
+
+/**
+ * Restore the min-heap of readers below slot x.
+ */
+static void heap_down(struct run_reader** heap, size_t count, size_t x)
+{
+   for (;;)
+   {
+      size_t least = x;
+      size_t child = 2 * x + 1;
+
+      if (child < count && reader_less(heap[child], heap[least]))
+	 least = child;
+      if (child + 1 < count && reader_less(heap[child + 1], heap[least]))
+	 least = child + 1;
+
+      if (least == x)
+	 break;
+
+      struct run_reader* swap = heap[x];
+      heap[x] = heap[least];
+      heap[least] = swap;
+      x = least;
+   }
+}
+
+/**
+ * Buffered writes to one part of the manifest file.
+ */
+struct write_stream
+{
+   int fd;
+   off_t offset;
+   size_t len;
+   bool ok;
+   char data[MANIFEST_IO_SIZE];
+};
+
+static void stream_flush(struct write_stream* stream)
+{
+   size_t done = 0;
+
+   while (stream->ok && done < stream->len)
+   {
+      ssize_t bytes = pwrite(stream->fd, stream->data + done,
+			     stream->len - done, stream->offset);
+
+      if (bytes < 0 && errno == EINTR)
+	 continue;
+
+      if (bytes <= 0)
+	 stream->ok = false;
+      else
+      {
+	 done += bytes;
+	 stream->offset += bytes;
+      }
+   }
+
+   stream->len = 0;
+}
+
+static void stream_write(struct write_stream* stream, const void* data,
+			 size_t len)
+{
+   while (len)
+   {
+      size_t n = sizeof(stream->data) - stream->len;
+
+      if (n > len)
+	 n = len;
+
+      memcpy(stream->data + stream->len, data, n);
+      stream->len += n;
+      data = (const char*)data + n;
+      len -= n;
+
+      if (stream->len == sizeof(stream->data))
+	 stream_flush(stream);
+   }
+}
+
+/**
+ * Write the records in path order, fixing up their roots and path
+ * offsets, along with their paths and the hash table. Records still in
+ * memory are sorted there; once there are runs on disk, the rest becomes
+ * a run too and the runs are merged, so memory stays at a buffer per
+ * run. The hash table is filled in through a mapping of the file.
+ */
+static bool write_records(struct manifest_writer* writer,
+			  const struct manifest_header* h,
+			  const uint32_t* remap, uint32_t* table,
+			  struct write_stream* records,
+			  struct write_stream* strings)
+{
+   struct run_reader* readers = NULL;
+   struct run_reader** heap = NULL;
+   uint64_t path = h->strings_size - writer->total_strings;
+   size_t heap_count = 0;
+   bool error = false;
+   uint64_t x;
+
+   if (writer->nruns)
+   {
+      if (writer->count && !spill_run(writer))
+	 return false;
+
+      readers = (struct run_reader*)calloc(writer->nruns, sizeof(*readers));
+      heap = (struct run_reader**)calloc(writer->nruns, sizeof(*heap));
+
+      for (x = 0; readers && heap && x < writer->nruns; x++)
+      {
+	 struct run_reader* reader = &readers[x];
+
+	 reader->offset = writer->runs[x].offset;
+	 reader->left = writer->runs[x].count;
+	 reader->size = MANIFEST_IO_SIZE;
+	 if (!(reader->data = (char*)malloc(reader->size)))
+	    break;
+
+	 if (run_next(reader, writer->spill_fd, &error))
+	    heap[heap_count++] = reader;
+      }
+
+      if (!readers || !heap || x < writer->nruns || error)
+      {
+	 error = true;
+	 goto done;
+      }
+
+      for (x = heap_count; x-- > 0; )
+	 heap_down(heap, heap_count, x);
+   }
+   else
+   {
+      qsort_r(writer->records, writer->count, sizeof(struct manifest_record),
+	      record_compare, writer->strings);
+   }
+
+   for (x = 0; x < h->count; x++)
+   {
+      struct manifest_record r;
+      const char* p;
+
+      if (heap)
+      {
+	 if (!heap_count)
+	 {
+	    error = true;
+	    break;
+	 }
+	 r = heap[0]->record;
+	 p = heap[0]->path;
+      }
+      else
+      {
+	 r = writer->records[x];
+	 p = writer->strings + r.path;
+      }
+
+      r.root = r.root < writer->nroots ? remap[r.root] : MANIFEST_NO_ROOT;
+      r.path = path;
+      path += r.path_len;
+
+      stream_write(records, &r, sizeof(r));
+      stream_write(strings, p, r.path_len);
+
+      uint64_t b = r.hash & (h->buckets - 1);
+
+      while (table[b])
+	 b = (b + 1) & (h->buckets - 1);
+      table[b] = x + 1;
+
+      /* the path is in the reader's buffer until it moves on */
+      if (heap)
+      {
+	 if (!run_next(heap[0], writer->spill_fd, &error))
+	 {
+	    if (error)
+	       break;
+	    heap[0] = heap[--heap_count];
+	 }
+	 heap_down(heap, heap_count, 0);
+      }
+   }
+
+ done:
+   for (x = 0; readers && x < writer->nruns; x++)
+      free(readers[x].data);
+   free(readers);
+   free(heap);
+   return !error;
+}
+
+bool manifest_write(struct manifest_writer* writer, const char* file)
+{
+   bool result = false;
+   struct manifest_header h;
+   struct write_stream* streams = NULL;
+   uint32_t* remap = NULL;
+   uint64_t* root_table = NULL;
+   void* map = MAP_FAILED;
+   size_t map_size = 0;
+   uint32_t roots = 0;
+   uint64_t roots_size = 0;
+   char* tmp = NULL;
+   int fd = -1;
+   size_t x;
+
+   /* only keep the roots still referenced */
+   remap = (uint32_t*)malloc((writer->nroots + 1) * sizeof(uint32_t));
+   root_table = (uint64_t*)malloc((writer->nroots + 1) * sizeof(uint64_t));
+   streams = (struct write_stream*)calloc(2, sizeof(*streams));
+   if (!remap || !root_table || !streams)
+      goto done;
+
+   for (x = 0; x < writer->nroots; x++)
+   {
+      remap[x] = MANIFEST_NO_ROOT;
+
+      if (writer->used_roots[x])
+      {
+	 remap[x] = roots;
+	 root_table[roots++] = roots_size;
+	 roots_size += strlen(writer->roots[x]) + 1;
+      }
+   }
+
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+   h.version = MANIFEST_VERSION;
+   h.roots = roots;
+   h.count = writer->total;
+   for (h.buckets = 16; h.buckets < writer->total * 2; h.buckets *= 2)
+      ;
+
+   h.root_table = sizeof(h);
+   h.records = h.root_table + ((roots * sizeof(uint64_t) + 7) & ~7ULL);
+   h.table = h.records + writer->total * sizeof(struct manifest_record);
+   h.strings = h.table + h.buckets * sizeof(uint32_t);
+   h.strings_size = roots_size + writer->total_strings;
+
+   size_t len = strlen(file);
+   if (!(tmp = (char*)malloc(len + 5)))
+      goto done;
+   memcpy(tmp, file, len);
+   memcpy(tmp + len, ".tmp", 5);
+
+   fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0666);
+   if (fd == -1)
+      goto done;
+
+   /* the table starts out as zeros, the empty buckets */
+   off_t map_start = h.table & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+
+   map_size = h.strings - map_start;
+   if (ftruncate(fd, h.strings + h.strings_size) < 0 ||
+       (map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, map_start)) == MAP_FAILED)
+      goto done;
+
+   static const char pad[8];
+   struct write_stream* records = &streams[0];
+   struct write_stream* strings = &streams[1];
+
+   records->fd = strings->fd = fd;
+   records->ok = strings->ok = true;
+   strings->offset = h.strings;
+
+   stream_write(records, &h, sizeof(h));
+   stream_write(records, root_table, roots * sizeof(uint64_t));
+   stream_write(records, pad, h.records - h.root_table - roots * sizeof(uint64_t));
+
+   for (x = 0; x < writer->nroots; x++)
+      if (remap[x] != MANIFEST_NO_ROOT)
+	 stream_write(strings, writer->roots[x], strlen(writer->roots[x]) + 1);
+
+   bool ok = write_records(writer, &h, remap,
+			   (uint32_t*)((char*)map + (h.table - map_start)),
+			   records, strings);
+
+   stream_flush(records);
+   stream_flush(strings);
+   ok = ok && records->ok && strings->ok;
+
+   ok = munmap(map, map_size) == 0 && ok;
+   map = MAP_FAILED;
+   ok = close(fd) == 0 && ok;
+   fd = -1;
+
+   if (ok && rename(tmp, file) == 0)
+      result = true;
+
+ done:
+   if (map != MAP_FAILED)
+      munmap(map, map_size);
+   if (fd != -1)
+      close(fd);
+   if (tmp && !result)
+      unlink(tmp);
+   free(tmp);
+   free(streams);
+   free(root_table);
+   free(remap);
+   return result;
+}
+
+void manifest_writer_free(struct manifest_writer* writer)
+{
+   uint32_t x;
+
+   if (!writer)
+      return;
+
+   for (x = 0; x < writer->nroots; x++)
+      free(writer->roots[x]);
+   free(writer->roots);
+   free(writer->used_roots);
+   free(writer->records);
+   free(writer->strings);
+   free(writer->runs);
+   free(writer->dir);
+   if (writer->spill_fd != -1)
+      close(writer->spill_fd);
+   pthread_mutex_destroy(&writer->lock);
+   free(writer);
+}
@@ -0,0 +1,166 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/**
+ * @file
+ *
+ * Snapshot manifests. Every snapshot gets a file next to it listing each
+ * regular file and directory with its size, modification time, inode,
+ * mode and where its data is actually stored. The next snapshot maps it
+ * into memory and looks files up in its hash table instead of stat'ing
+ * the previous snapshot tree. Other entries, like symlinks and fifos,
+ * are listed with their change time in place of the modification time,
+ * as chmod and chown only show there.
+ *
+ * Records are kept in path order: byte order, except that '/' sorts
+ * before anything else. Everything below a directory is then one run
+ * of records, ordered by the name of the directory's entries, which
+ * lets a sorted directory listing be merged against it.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define MANIFEST_SUFFIX ".manifest"
+
+/* root index of entries whose storage location is not known */
+#define MANIFEST_NO_ROOT 0xffffffffU
+
+/* bytes of the hash kept over the data of a file */
+#define MANIFEST_DIGEST_SIZE 16
+
+/* entry flags */
+#define MANIFEST_HAS_DIGEST 0x1
+/* the stored copy is a chunk recipe, not the data */
+#define MANIFEST_IS_RECIPE 0x2
+
+struct manifest;
+struct manifest_writer;
+
+/**
+ * A file as recorded in a manifest. Its data is stored at root/path,
+ * where root is a snapshot directory.
+ */
+struct manifest_entry
+{
+   uint64_t size;
+   int64_t mtime_ns;
+   uint64_t ino;
+   uint32_t mode;
+   uint32_t root;
+   uint32_t flags;
+   /* hash of the data of the file, with MANIFEST_HAS_DIGEST */
+   unsigned char digest[MANIFEST_DIGEST_SIZE];
+};
+
+/**
+ * Map a manifest into memory.
+ *
+ * @return NULL if it does not exist or is not valid.
+ */
+struct manifest* manifest_open(const char* file);
+
+void manifest_close(struct manifest* manifest);
+
+/**
+ * Look up path, which is relative to the snapshot directory.
+ */
+bool manifest_lookup(struct manifest* manifest, const char* path,
+		     struct manifest_entry* entry);
+
+/**
+ * Range of records below dir, which has no trailing '/'. An empty dir
+ * covers every record.
+ */
+void manifest_range(struct manifest* manifest, const char* dir,
+		    size_t* begin, size_t* end);
+
+/**
+ * Record number index, in path order.
+ *
+ * @param len Set to the length of the path, which is not NUL terminated.
+ * @return the path, or NULL if the record is not valid.
+ */
+const char* manifest_get(struct manifest* manifest, size_t index,
+			 size_t* len, struct manifest_entry* entry);
+
+/**
+ * Advise the kernel whether the manifest will be read in path order
+ * rather than looked up at random.
+ */
+void manifest_advise(struct manifest* manifest, bool sequential);
+
+/**
+ * Path of a storage root, or NULL if root is not valid.
+ */
+const char* manifest_root(struct manifest* manifest, uint32_t root);
+
+/**
+ * Start a new manifest. Roots of prev, if given, keep their indexes.
+ *
+ * @param dir Directory for an unnamed file holding sorted runs of the
+ * records once there are too many to keep in memory, or NULL to keep
+ * them all in memory.
+ */
+struct manifest_writer* manifest_writer_new(struct manifest* prev,
+					    const char* dir);
+
+/**
+ * Index of a storage root, adding it if needed.
+ */
+uint32_t manifest_writer_root(struct manifest_writer* writer, const char* root);
+
+/**
+ * Record a file. Safe to call from several threads.
+ */
+bool manifest_add(struct manifest_writer* writer, const char* path,
+		  const struct manifest_entry* entry);
+
+/**
+ * Carry records begin to end of manifest over, keeping their roots. The
+ * writer must have been started from manifest.
+ */
+bool manifest_add_range(struct manifest_writer* writer,
+			struct manifest* manifest, size_t begin, size_t end);
+
+/**
+ * Write the manifest to file, replacing it atomically.
+ */
+bool manifest_write(struct manifest_writer* writer, const char* file);
+
+void manifest_writer_free(struct manifest_writer* writer);
+
+static inline int64_t stat_mtime_ns(const struct stat* s)
+{
+   return (int64_t)s->st_mtim.tv_sec * 1000000000 + s->st_mtim.tv_nsec;
+}
+
+static inline int64_t stat_ctime_ns(const struct stat* s)
+{
+   return (int64_t)s->st_ctim.tv_sec * 1000000000 + s->st_ctim.tv_nsec;
+}
+
+#endif
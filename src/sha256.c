@@ -0,0 +1,148 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t k[64] =
+{
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror(uint32_t x, int n)
+{
+   return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(struct sha256* ctx, const unsigned char* p)
+{
+   uint32_t w[64];
+   uint32_t a, b, c, d, e, f, g, h;
+   int x;
+
+   for (x = 0; x < 16; x++)
+      w[x] = (uint32_t)p[x*4] << 24 | (uint32_t)p[x*4+1] << 16 |
+	 (uint32_t)p[x*4+2] << 8 | p[x*4+3];
+
+   for (; x < 64; x++)
+   {
+      uint32_t s0 = ror(w[x-15], 7) ^ ror(w[x-15], 18) ^ (w[x-15] >> 3);
+      uint32_t s1 = ror(w[x-2], 17) ^ ror(w[x-2], 19) ^ (w[x-2] >> 10);
+      w[x] = w[x-16] + s0 + w[x-7] + s1;
+   }
+
+   a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+   e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+   for (x = 0; x < 64; x++)
+   {
+      uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) +
+	 ((e & f) ^ (~e & g)) + k[x] + w[x];
+      uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) +
+	 ((a & b) ^ (a & c) ^ (b & c));
+
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+   }
+
+   ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+   ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(struct sha256* ctx)
+{
+   static const uint32_t init[8] =
+   {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+   };
+
+   memcpy(ctx->state, init, sizeof(init));
+   ctx->length = 0;
+   ctx->used = 0;
+}
+
+void sha256_update(struct sha256* ctx, const void* data, size_t len)
+{
+   const unsigned char* p = (const unsigned char*)data;
+
+   ctx->length += len;
+
+   if (ctx->used)
+   {
+      size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+
+      memcpy(ctx->block + ctx->used, p, n);
+      ctx->used += n;
+      p += n;
+      len -= n;
+
+      if (ctx->used < 64)
+	 return;
+
+      sha256_block(ctx, ctx->block);
+      ctx->used = 0;
+   }
+
+   for (; len >= 64; p += 64, len -= 64)
+      sha256_block(ctx, p);
+
+   memcpy(ctx->block, p, len);
+   ctx->used = len;
+}
+
+void sha256_final(struct sha256* ctx, unsigned char digest[SHA256_SIZE])
+{
+   uint64_t bits = ctx->length * 8;
+   int x;
+
+   ctx->block[ctx->used++] = 0x80;
+
+   if (ctx->used > 56)
+   {
+      memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+      sha256_block(ctx, ctx->block);
+      ctx->used = 0;
+   }
+
+   memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+
+   for (x = 0; x < 8; x++)
+      ctx->block[56 + x] = bits >> (56 - x * 8);
+
+   sha256_block(ctx, ctx->block);
+
+   for (x = 0; x < 8; x++)
+   {
+      digest[x*4] = ctx->state[x] >> 24;
+      digest[x*4+1] = ctx->state[x] >> 16;
+      digest[x*4+2] = ctx->state[x] >> 8;
+      digest[x*4+3] = ctx->state[x];
+   }
+}
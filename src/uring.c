@@ -0,0 +1,279 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#ifdef USE_LIBURING
+
+bool uring_init(struct uring* ring, unsigned entries)
+{
+   ring->pending = 0;
+   return io_uring_queue_init(entries, &ring->ring, 0) == 0;
+}
+
+void uring_exit(struct uring* ring)
+{
+   io_uring_queue_exit(&ring->ring);
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring)
+{
+   struct io_uring_sqe* sqe = io_uring_get_sqe(&ring->ring);
+
+   if (sqe)
+   {
+      memset(sqe, 0, sizeof(*sqe));
+      ring->pending++;
+   }
+
+   return sqe;
+}
+
+int uring_submit(struct uring* ring, unsigned wait)
+{
+   int ret;
+
+   do
+   {
+      ret = io_uring_submit_and_wait(&ring->ring, wait);
+   } while (ret == -EINTR);
+
+   if (ret >= 0)
+      ring->pending = 0;
+
+   return ret;
+}
+
+bool uring_next_cqe(struct uring* ring, struct io_uring_cqe* cqe, bool wait)
+{
+   struct io_uring_cqe* next;
+   int ret;
+
+   do
+   {
+      ret = wait ? io_uring_wait_cqe(&ring->ring, &next) :
+	 io_uring_peek_cqe(&ring->ring, &next);
+   } while (wait && (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY));
+
+   if (ret < 0)
+      return false;
+
+   *cqe = *next;
+   io_uring_cqe_seen(&ring->ring, next);
+
+   return true;
+}
+
+#else
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+   return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned submit, unsigned wait,
+				     unsigned flags)
+{
+   return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+bool uring_init(struct uring* ring, unsigned entries)
+{
+   struct io_uring_params p;
+
+   memset(ring, 0, sizeof(*ring));
+   memset(&p, 0, sizeof(p));
+
+   ring->fd = sys_io_uring_setup(entries, &p);
+   if (ring->fd < 0)
+      return false;
+
+   ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (ring->cq_ring_size > ring->sq_ring_size)
+	 ring->sq_ring_size = ring->cq_ring_size;
+      ring->cq_ring_size = 0;
+   }
+
+   ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if (ring->sq_ring == MAP_FAILED)
+      goto fail;
+
+   if (ring->cq_ring_size)
+   {
+      ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+      {
+	 munmap(ring->sq_ring, ring->sq_ring_size);
+	 goto fail;
+      }
+   }
+   else
+   {
+      ring->cq_ring = ring->sq_ring;
+   }
+
+   ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size,
+					   PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE,
+					   ring->fd, IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED)
+   {
+      if (ring->cq_ring_size)
+	 munmap(ring->cq_ring, ring->cq_ring_size);
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      goto fail;
+   }
+
+   char* sq = (char*)ring->sq_ring;
+   char* cq = (char*)ring->cq_ring;
+
+   ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+   ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+   ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+   ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+   ring->sq_entries = p.sq_entries;
+   ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+   ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+   ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+   return true;
+
+ fail:
+   close(ring->fd);
+   return false;
+}
+
+void uring_exit(struct uring* ring)
+{
+   munmap(ring->sqes, ring->sqes_size);
+   if (ring->cq_ring_size)
+      munmap(ring->cq_ring, ring->cq_ring_size);
+   munmap(ring->sq_ring, ring->sq_ring_size);
+   close(ring->fd);
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring)
+{
+   unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+   unsigned tail = *ring->sq_tail + ring->pending;
+
+   if (tail - head >= ring->sq_entries)
+      return NULL;
+
+   unsigned index = tail & *ring->sq_mask;
+   struct io_uring_sqe* sqe = &ring->sqes[index];
+
+   ring->sq_array[index] = index;
+   ring->pending++;
+
+   memset(sqe, 0, sizeof(*sqe));
+   return sqe;
+}
+
+int uring_submit(struct uring* ring, unsigned wait)
+{
+   unsigned submit = ring->pending;
+   int ret;
+
+   __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+   ring->pending = 0;
+
+   do
+   {
+      ret = sys_io_uring_enter(ring->fd, submit, wait,
+			       wait ? IORING_ENTER_GETEVENTS : 0);
+   } while (ret < 0 && errno == EINTR);
+
+   return ret < 0 ? -errno : ret;
+}
+
+bool uring_next_cqe(struct uring* ring, struct io_uring_cqe* cqe, bool wait)
+{
+   for (;;)
+   {
+      unsigned head = *ring->cq_head;
+
+      if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+      {
+	 *cqe = ring->cqes[head & *ring->cq_mask];
+	 __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	 return true;
+      }
+
+      if (!wait)
+	 return false;
+
+      if (sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+	  errno != EINTR && errno != EAGAIN && errno != EBUSY)
+	 return false;
+   }
+}
+
+#endif
+
+void uring_prep_statx(struct io_uring_sqe* sqe, int dirfd, const char* path,
+		      int flags, unsigned mask, struct statx* buf)
+{
+   sqe->opcode = IORING_OP_STATX;
+   sqe->fd = dirfd;
+   sqe->addr = (unsigned long)path;
+   sqe->len = mask;
+   sqe->off = (unsigned long)buf;
+   sqe->statx_flags = flags;
+}
+
+void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf,
+		     unsigned len, off_t offset)
+{
+   sqe->opcode = IORING_OP_READ;
+   sqe->fd = fd;
+   sqe->addr = (unsigned long)buf;
+   sqe->len = len;
+   sqe->off = offset;
+}
+
+void uring_prep_write(struct io_uring_sqe* sqe, int fd, const void* buf,
+		      unsigned len, off_t offset)
+{
+   sqe->opcode = IORING_OP_WRITE;
+   sqe->fd = fd;
+   sqe->addr = (unsigned long)buf;
+   sqe->len = len;
+   sqe->off = offset;
+}
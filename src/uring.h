@@ -0,0 +1,107 @@
+/*
+ * Incremental Snapshot
+ *
+ * Copyright (C) 2006, Joshua D. Henderson <www.digitalpeer.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/**
+ * @file
+ *
+ * Minimal io_uring interface. It is backed either by liburing or, by
+ * default, by the raw io_uring_setup()/io_uring_enter() system calls.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#ifdef USE_LIBURING
+#include <liburing.h>
+#endif
+
+struct statx;
+
+struct uring
+{
+#ifdef USE_LIBURING
+   struct io_uring ring;
+#else
+   int fd;
+   unsigned* sq_head;
+   unsigned* sq_tail;
+   unsigned* sq_mask;
+   unsigned* sq_array;
+   unsigned sq_entries;
+   struct io_uring_sqe* sqes;
+   unsigned* cq_head;
+   unsigned* cq_tail;
+   unsigned* cq_mask;
+   struct io_uring_cqe* cqes;
+   void* sq_ring;
+   size_t sq_ring_size;
+   void* cq_ring;
+   size_t cq_ring_size;
+   size_t sqes_size;
+#endif
+   unsigned pending;
+};
+
+/**
+ * Set up a ring with room for entries submissions.
+ *
+ * @return false if io_uring is not available.
+ */
+bool uring_init(struct uring* ring, unsigned entries);
+
+void uring_exit(struct uring* ring);
+
+/**
+ * Get a cleared submission entry, or NULL when the queue is full.
+ */
+struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+
+/**
+ * Submit queued entries and wait for at least wait completions. The
+ * kernel stops taking entries at the first one it cannot start, without
+ * waiting; the rest stay queued, which would split linked entries, so a
+ * short count should be followed by uring_exit().
+ *
+ * @return number of entries submitted, or -errno.
+ */
+int uring_submit(struct uring* ring, unsigned wait);
+
+/**
+ * Take the next completion, waiting for one if wait is set. Interrupted
+ * waits are retried.
+ *
+ * @return false if there is no completion, or with wait only if the ring
+ * is unusable.
+ */
+bool uring_next_cqe(struct uring* ring, struct io_uring_cqe* cqe, bool wait);
+
+void uring_prep_statx(struct io_uring_sqe* sqe, int dirfd, const char* path,
+		      int flags, unsigned mask, struct statx* buf);
+void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf,
+		     unsigned len, off_t offset);
+void uring_prep_write(struct io_uring_sqe* sqe, int fd, const void* buf,
+		      unsigned len, off_t offset);
+
+#endif